@@ -0,0 +1,73 @@
+// Fixed point color conversion and blending
+
+#include "color.h"
+#include "led.h"
+
+// 255 * (i / 255)^2.2, the duty cycle that looks like brightness i
+const uint8_t PROGMEM color_gamma_table[256] = {
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+	  1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+	  3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+	  6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+	 12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+	 20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+	 30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+	 42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+	 56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+	 73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+	 91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+	113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+	137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+	163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+	192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+	223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
+// HSV to RGB with multiplies and shifts only.  The hue splits into six
+// sectors of about 43 steps, (h * 6) >> 8 being the sector and the low
+// byte the position within it; the three channels are then v, v
+// scaled down by the saturation, and v ramping between the two.
+// Estimated at 60 to 70 cycles by instruction count (7 hardware
+// multiplies and the sector switch), about 80 with three gamma
+// lookups; not measured on the target.
+void color_hsv(uint8_t h, uint8_t s, uint8_t v, uint8_t *rgb)
+{
+	uint16_t h6 = h * 6;
+	uint8_t sector = h6 >> 8;
+	uint8_t frac = h6;
+	uint8_t p, q, t;
+
+	p = color_scale(v, 255 - s);
+	q = color_scale(v, 255 - color_scale(s, frac));
+	t = color_scale(v, 255 - color_scale(s, 255 - frac));
+
+	switch (sector) {
+		case 0: rgb[RED] = v; rgb[GREEN] = t; rgb[BLUE] = p; break;
+		case 1: rgb[RED] = q; rgb[GREEN] = v; rgb[BLUE] = p; break;
+		case 2: rgb[RED] = p; rgb[GREEN] = v; rgb[BLUE] = t; break;
+		case 3: rgb[RED] = p; rgb[GREEN] = q; rgb[BLUE] = v; break;
+		case 4: rgb[RED] = t; rgb[GREEN] = p; rgb[BLUE] = v; break;
+		default: rgb[RED] = v; rgb[GREEN] = p; rgb[BLUE] = q; break;
+	}
+}
+
+void color_add_rgb(uint8_t *rgb, const uint8_t *add)
+{
+	rgb[RED] = color_add(rgb[RED], add[RED]);
+	rgb[GREEN] = color_add(rgb[GREEN], add[GREEN]);
+	rgb[BLUE] = color_add(rgb[BLUE], add[BLUE]);
+}
+
+void color_scale_rgb(uint8_t *rgb, uint8_t scale)
+{
+	rgb[RED] = color_scale(rgb[RED], scale);
+	rgb[GREEN] = color_scale(rgb[GREEN], scale);
+	rgb[BLUE] = color_scale(rgb[BLUE], scale);
+}
+
+void color_blend_rgb(uint8_t *rgb, const uint8_t *to, uint8_t amount)
+{
+	rgb[RED] = color_blend(rgb[RED], to[RED], amount);
+	rgb[GREEN] = color_blend(rgb[GREEN], to[GREEN], amount);
+	rgb[BLUE] = color_blend(rgb[BLUE], to[BLUE], amount);
+}
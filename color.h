@@ -0,0 +1,49 @@
+#ifndef color_h__
+#define color_h__
+
+#include <stdint.h>
+#include "hal.h"
+
+// 8 bit fixed point color.  Hue runs 0 to 255 around the color wheel,
+// starting and ending at red, saturation and value 0 to 255.  Colors
+// are kept linear (as seen by the eye) until led_update() turns them
+// into LED duty cycles through color_gamma().
+
+// Channel arithmetic, saturating at 0 and 255
+static inline uint8_t color_add(uint8_t a, uint8_t b)
+{
+	uint16_t s = a + b;
+
+	return s > 255 ? 255 : s;
+}
+
+static inline uint8_t color_sub(uint8_t a, uint8_t b)
+{
+	return a > b ? a - b : 0;
+}
+
+// a * scale / 256, so 255 keeps nearly all of a and 0 none
+static inline uint8_t color_scale(uint8_t a, uint8_t scale)
+{
+	return ((uint16_t)a * scale) >> 8;
+}
+
+// From a at amount 0 to b at amount 255
+static inline uint8_t color_blend(uint8_t a, uint8_t b, uint8_t amount)
+{
+	return color_scale(a, 255 - amount) + color_scale(b, amount);
+}
+
+extern const uint8_t PROGMEM color_gamma_table[256];
+
+static inline uint8_t color_gamma(uint8_t v)
+{
+	return pgm_read_byte(&color_gamma_table[v]);
+}
+
+void color_hsv(uint8_t h, uint8_t s, uint8_t v, uint8_t *rgb);
+void color_add_rgb(uint8_t *rgb, const uint8_t *add);
+void color_scale_rgb(uint8_t *rgb, uint8_t scale);
+void color_blend_rgb(uint8_t *rgb, const uint8_t *to, uint8_t amount);
+
+#endif
@@ -0,0 +1,195 @@
+// Settings saved in EEPROM, see config.h
+
+#include <stddef.h>
+#include "hal.h"
+#include "config.h"
+#include "keymap.h"
+#include "lighting.h"
+#include "macro.h"
+#include "matrix.h"
+#include "usb_keyboard.h"
+
+// Committed slots end with this, the commit byte written last
+struct config_header {
+	uint16_t seq;
+	uint16_t length;
+	uint16_t crc;
+	uint8_t version;
+	uint8_t commit;
+};
+
+#define CONFIG_COMMIT	0xA5
+
+// What is saved, in order
+struct config_item {
+	void *data;
+	uint16_t size;
+};
+
+static const struct config_item PROGMEM config_items[] = {
+	{keymap_cache, sizeof(keymap_cache)},
+	{&lighting_config, sizeof(lighting_config)},
+	{macro_user, sizeof(macro_user)},
+	{&matrix_config, sizeof(matrix_config)},
+};
+
+#define CONFIG_ITEMS	(sizeof(config_items) / sizeof(config_items[0]))
+#define CONFIG_LENGTH	(sizeof(keymap_cache) + sizeof(lighting_config) + \
+	sizeof(macro_user) + sizeof(matrix_config))
+// A record, rounded up to a power of two so the slots divide the EEPROM
+#define CONFIG_RECORD	(CONFIG_LENGTH + sizeof(struct config_header))
+#define CONFIG_SLOT_SIZE	(CONFIG_RECORD <= 128 ? 128 :		\
+	CONFIG_RECORD <= 256 ? 256 : CONFIG_RECORD <= 512 ? 512 :	\
+	CONFIG_RECORD <= 1024 ? 1024 : 2048)
+#define CONFIG_SLOTS	((E2END + 1) / CONFIG_SLOT_SIZE)
+#define CONFIG_HEADER(slot)	((uint8_t *)(uintptr_t)((slot) * \
+	CONFIG_SLOT_SIZE + CONFIG_SLOT_SIZE - sizeof(struct config_header)))
+#define CONFIG_DATA(slot)	((uint8_t *)(uintptr_t)((slot) * CONFIG_SLOT_SIZE))
+
+// fails to compile if the settings leave fewer than two slots, where a
+// save cut short would lose the last good record
+typedef char config_fits[CONFIG_RECORD <= CONFIG_SLOT_SIZE &&
+	CONFIG_SLOTS >= 2 ? 1 : -1];
+
+// the slot and sequence number of the newest record
+static uint8_t slot_last = CONFIG_SLOTS - 1;
+static uint16_t seq_last = 0;
+
+// settings changed since the last save started, and when
+static uint8_t dirty = 0;
+static uint16_t dirty_ms;
+
+// the save in progress
+#define CONFIG_IDLE		0
+#define CONFIG_INVALIDATE	1
+#define CONFIG_DATA_BYTES	2
+#define CONFIG_HEADER_BYTES	3
+static uint8_t state = CONFIG_IDLE;
+static uint8_t slot, item, pos;
+static uint16_t offset, written, crc;
+static struct config_header header;
+
+// CRC of a slot's settings, as stored
+static uint16_t config_crc(uint8_t s)
+{
+	const uint8_t *p = CONFIG_DATA(s);
+	uint16_t i, c = 0xFFFF;
+
+	for (i = 0; i < CONFIG_LENGTH; i++)
+		c = _crc16_update(c, eeprom_read_byte(p++));
+	return c;
+}
+
+// Find the newest committed record and load it over the built in
+// settings, which stay as they are if there is none
+void config_init(void)
+{
+	struct config_header h;
+	const uint8_t *p;
+	uint8_t s, found = 0;
+	uint8_t i;
+	uint16_t size;
+
+	for (s = 0; s < CONFIG_SLOTS; s++) {
+		eeprom_read_block(&h, CONFIG_HEADER(s), sizeof(h));
+		if (h.commit != CONFIG_COMMIT || h.version != CONFIG_VERSION ||
+		    h.length != CONFIG_LENGTH)
+			continue;
+		if (found && (int16_t)(h.seq - seq_last) <= 0)
+			continue;
+		if (config_crc(s) != h.crc)
+			continue;
+		slot_last = s;
+		seq_last = h.seq;
+		found = 1;
+	}
+	if (!found)
+		return;
+
+	p = CONFIG_DATA(slot_last);
+	for (i = 0; i < CONFIG_ITEMS; i++) {
+		size = pgm_read_word(&config_items[i].size);
+		eeprom_read_block(pgm_read_ptr(&config_items[i].data), p, size);
+		p += size;
+	}
+}
+
+// Called by whatever changes a saved setting
+void config_changed(void)
+{
+	dirty = 1;
+	dirty_ms = usb_ms();
+}
+
+// Save without waiting out CONFIG_SAVE_DELAY_MS
+void config_save(void)
+{
+	dirty = 1;
+	dirty_ms = usb_ms() - CONFIG_SAVE_DELAY_MS;
+}
+
+uint8_t config_busy(void)
+{
+	return dirty || state != CONFIG_IDLE;
+}
+
+// From the main loop: move a save on by at most one byte
+void config_task(void)
+{
+	const uint8_t *data;
+	uint8_t b;
+
+	if (state == CONFIG_IDLE) {
+		if (!dirty || (uint16_t)(usb_ms() - dirty_ms) < CONFIG_SAVE_DELAY_MS)
+			return;
+		dirty = 0;
+		slot = slot_last + 1;
+		if (slot >= CONFIG_SLOTS)
+			slot = 0;
+		item = 0;
+		offset = 0;
+		written = 0;
+		crc = 0xFFFF;
+		state = CONFIG_INVALIDATE;
+	}
+	if (!eeprom_is_ready())
+		return;
+
+	switch (state) {
+	case CONFIG_INVALIDATE:
+		// no longer a valid record until the new header is complete
+		eeprom_update_byte(CONFIG_HEADER(slot) +
+			offsetof(struct config_header, commit), 0xFF);
+		state = CONFIG_DATA_BYTES;
+		break;
+	case CONFIG_DATA_BYTES:
+		// the CRC covers what is written, even if a setting changes
+		// in the middle of the save, which then just saves again
+		data = pgm_read_ptr(&config_items[item].data);
+		b = data[offset];
+		crc = _crc16_update(crc, b);
+		eeprom_update_byte(CONFIG_DATA(slot) + written++, b);
+		if (++offset >= pgm_read_word(&config_items[item].size)) {
+			offset = 0;
+			if (++item >= CONFIG_ITEMS) {
+				header.seq = seq_last + 1;
+				header.length = CONFIG_LENGTH;
+				header.crc = crc;
+				header.version = CONFIG_VERSION;
+				header.commit = CONFIG_COMMIT;
+				pos = 0;
+				state = CONFIG_HEADER_BYTES;
+			}
+		}
+		break;
+	case CONFIG_HEADER_BYTES:
+		eeprom_update_byte(CONFIG_HEADER(slot) + pos,
+			((uint8_t *)&header)[pos]);
+		if (++pos >= sizeof(header)) {
+			slot_last = slot;
+			seq_last = header.seq;
+			state = CONFIG_IDLE;
+		}
+		break;
+	}
+}
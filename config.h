@@ -0,0 +1,37 @@
+#ifndef config_h__
+#define config_h__
+
+#include <stdint.h>
+#include "hal.h"
+
+// Settings saved in EEPROM: the keymap, the lighting mode and color,
+// the recorded macros and the scan rate.
+// Each module keeps its settings in RAM, where they are used from;
+// config_init() fills them in from the newest valid record at boot, in
+// one pass, and the EEPROM is not read again.
+//
+// The EEPROM is split into slots, each the size of the settings and
+// their header rounded up to a power of two: 256 bytes, 16 slots, with
+// the default 2 keymap layers, 1024 bytes, 4 slots, with 8.  Every
+// save goes to the slot after the last one, so the writes are spread
+// over all of them.  A save starts once the settings have been left alone for
+// CONFIG_SAVE_DELAY_MS, so a burst of changes costs one save, and only
+// bytes that differ from what the slot held are written.  config_task()
+// writes one byte each time the EEPROM is ready, never waiting on it.
+//
+// A slot holds the settings followed by a header, written last, which
+// commits them: sequence number, length, CRC-16 and a version byte.
+// A save cut short leaves its slot without a valid header, so the
+// previous one is used instead.
+#define CONFIG_VERSION		2
+#ifndef CONFIG_SAVE_DELAY_MS
+#define CONFIG_SAVE_DELAY_MS	5000
+#endif
+
+void config_init(void);
+void config_changed(void);
+void config_save(void);
+void config_task(void);
+uint8_t config_busy(void);
+
+#endif
@@ -0,0 +1,176 @@
+// Configuration protocol on the vendor defined HID interface, see editor.h
+
+#include <string.h>
+#include "hal.h"
+#include "editor.h"
+#include "keymap.h"
+#include "lighting.h"
+#include "macro.h"
+#include "matrix.h"
+#include "config.h"
+
+struct editor_table {
+	void *data;
+	uint16_t size;
+	uint8_t writable;
+};
+
+static const struct editor_table PROGMEM tables[EDITOR_TABLES] = {
+	[EDITOR_KEYMAP]		= {keymap_cache, sizeof(keymap_cache), 1},
+	[EDITOR_LIGHTING]	= {&lighting_config, sizeof(lighting_config), 1},
+	[EDITOR_STATS]		= {(void *)&lighting_stats, sizeof(lighting_stats), 0},
+	[EDITOR_MACROS]		= {macro_user, sizeof(macro_user), 1},
+	[EDITOR_DEBUG]		= {(void *)&usb_debug_dropped, sizeof(usb_debug_dropped), 0},
+	[EDITOR_SCAN]		= {&matrix_config, sizeof(matrix_config), 1},
+	[EDITOR_SCAN_STATS]	= {&matrix_stats, sizeof(matrix_stats), 0},
+};
+
+static uint8_t rx[RAWHID_RX_SIZE];
+static uint8_t tx[RAWHID_TX_SIZE];
+static uint8_t tx_pending = 0;
+
+// the batch of writes in progress
+static uint16_t batch_bytes = 0;
+static uint16_t batch_crc = 0xFFFF;
+static uint8_t batch_status = EDITOR_OK;
+static uint8_t batch_tables = 0;
+
+static uint8_t editor_range(uint8_t table, uint16_t offset, uint8_t len)
+{
+	if (table >= EDITOR_TABLES)
+		return EDITOR_BAD_TABLE;
+	if (len > EDITOR_DATA_SIZE ||
+	    (uint32_t)offset + len > pgm_read_word(&tables[table].size))
+		return EDITOR_BAD_RANGE;
+	return EDITOR_OK;
+}
+
+static void editor_info(void)
+{
+	uint8_t i, *p = tx + EDITOR_HEADER_SIZE;
+	uint16_t size;
+
+	*p++ = EDITOR_PROTOCOL;
+	*p++ = EDITOR_TABLES;
+	for (i = 0; i < EDITOR_TABLES; i++) {
+		size = pgm_read_word(&tables[i].size);
+		*p++ = size;
+		*p++ = size >> 8;
+		*p++ = pgm_read_byte(&tables[i].writable);
+	}
+}
+
+static uint8_t editor_read(uint8_t table, uint16_t offset, uint8_t len)
+{
+	uint8_t status, intr_state;
+	const uint8_t *data;
+
+	status = editor_range(table, offset, len);
+	if (status != EDITOR_OK)
+		return status;
+	if (table == EDITOR_SCAN_STATS)
+		matrix_stats_update();
+	data = (const uint8_t *)pgm_read_ptr(&tables[table].data) + offset;
+	// the stats change under the interrupts
+	intr_state = SREG;
+	cli();
+	memcpy(tx + EDITOR_HEADER_SIZE, data, len);
+	SREG = intr_state;
+	return EDITOR_OK;
+}
+
+static void editor_write(uint8_t table, uint16_t offset, uint8_t len)
+{
+	uint8_t status, i;
+	uint8_t *data;
+
+	status = editor_range(table, offset, len);
+	if (status == EDITOR_OK && !pgm_read_byte(&tables[table].writable))
+		status = EDITOR_READ_ONLY;
+	// macro_task() reads the playing macro straight from macro_user
+	if (status == EDITOR_OK && table == EDITOR_MACROS && macro_playing())
+		status = EDITOR_BUSY;
+	if (status != EDITOR_OK) {
+		// reported with the batch, the rest of which still goes in
+		if (batch_status == EDITOR_OK)
+			batch_status = status;
+		return;
+	}
+	data = (uint8_t *)pgm_read_ptr(&tables[table].data) + offset;
+	for (i = 0; i < len; i++) {
+		data[i] = rx[EDITOR_HEADER_SIZE + i];
+		batch_crc = _crc16_update(batch_crc, data[i]);
+	}
+	batch_bytes += len;
+	batch_tables |= 1 << table;
+}
+
+// The batch is in: put it to use, then answer for all of it
+static void editor_batch_end(void)
+{
+	if (batch_tables & (1 << EDITOR_LIGHTING))
+		lighting_apply();
+	if ((batch_tables & (1 << EDITOR_SCAN)) && !matrix_apply() &&
+	    batch_status == EDITOR_OK)
+		batch_status = EDITOR_BAD_RANGE;
+	if (batch_tables)
+		config_changed();
+
+	tx[2] = batch_bytes;
+	tx[3] = batch_bytes >> 8;
+	tx[5] = batch_status;
+	tx[6] = batch_crc;
+	tx[7] = batch_crc >> 8;
+
+	batch_bytes = 0;
+	batch_crc = 0xFFFF;
+	batch_status = EDITOR_OK;
+	batch_tables = 0;
+}
+
+// From the main loop: handle at most one packet from the host.  A reply
+// the endpoint has no room for is held, and nothing more is read until
+// it goes, so a host that sends faster than it reads is NAKed.
+void editor_task(void)
+{
+	uint8_t table, len;
+	uint16_t offset;
+
+	if (tx_pending) {
+		if (usb_rawhid_send(tx) <= 0)
+			return;
+		tx_pending = 0;
+	}
+	if (usb_rawhid_recv(rx) <= 0)
+		return;
+
+	table = rx[1];
+	offset = rx[2] | (rx[3] << 8);
+	len = rx[4];
+	memset(tx, 0, sizeof(tx));
+	memcpy(tx, rx, EDITOR_HEADER_SIZE - 1);
+
+	switch (rx[0]) {
+	case EDITOR_INFO:
+		editor_info();
+		break;
+	case EDITOR_READ:
+		tx[5] = editor_read(table, offset, len);
+		break;
+	case EDITOR_WRITE:
+		editor_write(table, offset, len);
+		if (!(rx[5] & EDITOR_ACK))
+			return;
+		editor_batch_end();
+		break;
+	case EDITOR_SAVE:
+		config_save();
+		break;
+	default:
+		tx[5] = EDITOR_BAD_COMMAND;
+		break;
+	}
+	tx_pending = 1;
+	if (usb_rawhid_send(tx) > 0)
+		tx_pending = 0;
+}
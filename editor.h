@@ -0,0 +1,64 @@
+#ifndef editor_h__
+#define editor_h__
+
+#include <stdint.h>
+#include "usb_keyboard.h"
+
+// Configuration protocol on the vendor defined HID interface.  Every
+// packet is RAWHID_RX_SIZE bytes from the host, RAWHID_TX_SIZE back:
+//
+//   0  command
+//   1  table
+//   2  offset, low byte
+//   3  offset, high byte
+//   4  length
+//   5  flags
+//   6  data, up to EDITOR_DATA_SIZE bytes
+//
+// Settings are read and written as byte ranges of the tables below,
+// the same bytes config.c saves.  A large table goes up as a batch of
+// EDITOR_WRITE packets, and only the last one, with EDITOR_ACK set,
+// is answered: with the status, the number of bytes the batch wrote
+// (offset field) and their CRC-16 (bytes 6:7), so the host checks the
+// whole upload at once instead of waiting on every packet.  Each
+// packet is written to the table as it arrives, so a key pressed while
+// a keymap batch is going in finds some of the new keymap and some of
+// the old, though its release always undoes what its press did.  The
+// lighting and scan settings take effect, and the save is scheduled,
+// when the batch ends; a scan rate out of range is put back and
+// answered with EDITOR_BAD_RANGE.  Macros are refused with EDITOR_BUSY while one plays,
+// since it reads them in place; the host sends the batch again.
+// Changes are saved as usual, or at once with EDITOR_SAVE.
+//
+// Every other command is answered with the command, table, offset and
+// length echoed, byte 5 the status, and for EDITOR_READ the data.
+#define EDITOR_PROTOCOL		1
+#define EDITOR_HEADER_SIZE	6
+#define EDITOR_DATA_SIZE	(RAWHID_RX_SIZE - EDITOR_HEADER_SIZE)
+
+#define EDITOR_INFO		0x01	// data: protocol, table count, sizes
+#define EDITOR_READ		0x02
+#define EDITOR_WRITE		0x03
+#define EDITOR_SAVE		0x04
+
+#define EDITOR_ACK		0x01	// flags: last packet of a batch
+
+#define EDITOR_OK		0x00
+#define EDITOR_BAD_COMMAND	0x01
+#define EDITOR_BAD_TABLE	0x02
+#define EDITOR_BAD_RANGE	0x03
+#define EDITOR_READ_ONLY	0x04
+#define EDITOR_BUSY		0x05	// a macro is playing
+
+#define EDITOR_KEYMAP		0	// keymap_cache, layer by layer
+#define EDITOR_LIGHTING		1	// struct lighting_config
+#define EDITOR_STATS		2	// struct lighting_stats, read only
+#define EDITOR_MACROS		3	// macro_user
+#define EDITOR_DEBUG		4	// usb_debug_dropped, read only
+#define EDITOR_SCAN		5	// struct matrix_config
+#define EDITOR_SCAN_STATS	6	// struct matrix_stats, read only
+#define EDITOR_TABLES		7
+
+void editor_task(void);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef event_queue_h__
+#define event_queue_h__
+
+#include <stdint.h>
+
+// Single producer, single consumer queue of one byte events, used to
+// hand work from an interrupt to the main loop without disabling
+// interrupts.  The producer only writes head and the consumer only
+// writes tail; both are single bytes, so every access is atomic on
+// the AVR.  One slot is kept free to tell a full queue from an empty one.
+
+#define EVENT_QUEUE_SIZE	32	// must be a power of 2
+#define EVENT_QUEUE_MASK	(EVENT_QUEUE_SIZE - 1)
+
+// keeps the compiler from moving buffer accesses across index updates
+#define EVENT_QUEUE_BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+
+struct event_queue {
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	uint8_t buf[EVENT_QUEUE_SIZE];
+};
+
+// producer side, returns 0 if the queue is full and ev was not added
+static inline uint8_t event_queue_push(struct event_queue *q, uint8_t ev)
+{
+	uint8_t head = q->head, next = (head + 1) & EVENT_QUEUE_MASK;
+
+	if (next == q->tail)
+		return 0;
+	q->buf[head] = ev;
+	EVENT_QUEUE_BARRIER();
+	q->head = next;
+	return 1;
+}
+
+// consumer side, returns 0 if the queue is empty
+static inline uint8_t event_queue_pop(struct event_queue *q, uint8_t *ev)
+{
+	uint8_t tail = q->tail;
+
+	if (tail == q->head)
+		return 0;
+	EVENT_QUEUE_BARRIER();
+	*ev = q->buf[tail];
+	EVENT_QUEUE_BARRIER();
+	q->tail = (tail + 1) & EVENT_QUEUE_MASK;
+	return 1;
+}
+
+static inline uint8_t event_queue_count(const struct event_queue *q)
+{
+	return (q->head - q->tail) & EVENT_QUEUE_MASK;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef hal_h__
+#define hal_h__
+
+// Thin hardware abstraction for the matrix scan and the interrupt IN
+// endpoints.  On the AVR everything below is a plain register access,
+// so it costs nothing.  Building with HOST_BUILD defined maps the same
+// names onto simulated ports and a captured endpoint (see host/), so
+// the scan, keymap and report code can be run natively.  SIM_BUILD
+// keeps the AVR registers but moves the endpoints, see below.
+
+#ifdef HOST_BUILD
+#include "host/hal_host.h"
+#else
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/delay.h>
+#include <util/crc16.h>
+// avr-libc before 1.8.1 has no pgm_read_ptr(); pointers are 16 bits
+#ifndef pgm_read_ptr
+#define pgm_read_ptr(addr)	((void *)pgm_read_word(addr))
+#endif
+#endif
+
+// Key matrix: PORTB 0:3 drive the column mux, the five rows are read
+// back (active low) on PINB 4:6 and PINE 6:7.
+#define HAL_COLUMN_SELECT(c)	(PORTB = (PORTB & 0xF0) | (c))
+#define HAL_ROWS_READ()		(((PINB & 0x70) >> 4) | ((PINE & 0xC0) >> 3))
+
+// The same rows as a table, X(row, pin, bit), for code generated per
+// row, and a sample of them with the bit of every key down set: one
+// skip and one ori per row on the AVR, 2 cycles a row by instruction
+// count (the generated code has not been read or timed on the target).
+#define HAL_ROWS(X)		\
+	X(0, PINB, 4)		\
+	X(1, PINB, 5)		\
+	X(2, PINB, 6)		\
+	X(3, PINE, 6)		\
+	X(4, PINE, 7)
+#define HAL_ROW_COUNT(row, pin, bit)	+1
+#define HAL_ROW_TEST(row, pin, bit)		\
+	if (!((pin) & (1<<(bit))))		\
+		hal_rows |= 1<<(row);
+#define HAL_ROWS_SAMPLE()	\
+	({ uint8_t hal_rows = 0; HAL_ROWS(HAL_ROW_TEST) hal_rows; })
+
+// Interrupt on any edge of a row: pin change interrupt 0 for PINB 4:6,
+// external interrupts 6 and 7 for PINE 6:7.  Stale flags are cleared
+// first, so only edges after the enable count.
+#ifndef HOST_BUILD
+#define HAL_ROWS_WAKE_ENABLE()	(PCMSK0 = 0x70, PCIFR = (1<<PCIF0),	\
+	PCICR = (1<<PCIE0), EICRB = (1<<ISC70)|(1<<ISC60),		\
+	EIFR = (1<<INTF7)|(1<<INTF6), EIMSK |= (1<<INT7)|(1<<INT6))
+#define HAL_ROWS_WAKE_DISABLE()	(PCICR = 0, EIMSK &= ~((1<<INT7)|(1<<INT6)))
+#endif
+
+// LED matrix: PORTA selects the cathode, PORTC, PORTD and PORTF drive
+// the red, green and blue anodes
+#define HAL_LED_CATHODE(c)	(PORTA = (c))
+#define HAL_LED_ANODES(r, g, b)	(PORTC = (r), PORTD = (g), PORTF = (b))
+
+// busy wait for n CPU cycles, a constant, within an interrupt
+#ifndef HOST_BUILD
+#define HAL_LED_DELAY_CYCLES(n)	__builtin_avr_delay_cycles(n)
+#endif
+
+// wait for the rows to settle after a new column is selected
+#ifndef HOST_BUILD
+#define HAL_SETTLE_US(us)	_delay_us(us)
+#endif
+
+// Interrupt endpoints, used only outside of the control transfers.
+// An IN endpoint is written and released to send a packet, an OUT
+// endpoint read and released once its packet is used.
+//
+// SIM_BUILD is the AVR firmware for simavr, which models no at90usb
+// with 128K of flash.  It is built for the atmega2560 instead, which
+// has the same ports, timers, pin change and external interrupts and
+// GPIOR addresses, but no USB, so the USB interrupts are left out: the
+// endpoint number goes to GPIOR1, packet bytes to GPIOR2 and the
+// release to GPIOR0, where sim/latency.c picks them up.  IN endpoints
+// are always free, nothing ever arrives on an OUT endpoint and there
+// is no start of frame.
+#if defined(SIM_BUILD)
+#define HAL_EP_SELECT(n)	(GPIOR1 = (n))
+#define HAL_EP_WRITABLE()	1
+#define HAL_EP_WRITE(b)		(GPIOR2 = (b))
+#define HAL_EP_RELEASE()	(GPIOR0 = 1)
+#define HAL_EP_READABLE()	0
+#define HAL_EP_READ()		0
+#define HAL_EP_RELEASE_OUT()
+#define HAL_USB_FRAME()		0
+#elif !defined(HOST_BUILD)
+#define HAL_EP_SELECT(n)	(UENUM = (n))
+#define HAL_EP_WRITABLE()	(UEINTX & (1<<RWAL))
+#define HAL_EP_WRITE(b)		(UEDATX = (b))
+#define HAL_EP_RELEASE()	(UEINTX = 0x3A)
+#define HAL_EP_READABLE()	(UEINTX & (1<<RWAL))
+#define HAL_EP_READ()		(UEDATX)
+#define HAL_EP_RELEASE_OUT()	(UEINTX = 0x6B)
+#define HAL_USB_FRAME()		(UDFNUML)
+#endif
+
+#endif
@@ -0,0 +1,598 @@
+// Native replay bench for the scan, keymap and report pipeline.
+//
+// Drives the real TIMER0_COMPA_vect, and matrix_task() as the main loop
+// would, against the simulated ports in hal_host.c: a pseudo random
+// typist presses and releases keys on the matrix while the timer
+// "ticks", and every report released on the keyboard endpoint is
+// captured.  Prints the throughput of the hot
+// path; with -v it also dumps each captured report, so two builds can
+// be diffed for behaviour changes.
+//
+//   rgb_keyboard_host [-v] [-n ticks] [-s seed] [-b bounce ticks]
+//                     [-k max keys held] [-p 0 for boot protocol]
+//                     [-r full matrix passes per second]
+//                     [-i frames between IN tokens]
+//                     [-m lighting mode] [-q ticks away]
+//                     [-f frame phase in cycles]
+//   rgb_keyboard_host -l [-n frames] [-s seed]
+//
+// With -m the LED refresh and lighting interrupts run too, timers 1
+// and 2 kept in step with the simulated cycle count, and the lighting
+// frame and key press to light times are printed.
+//
+// With -q the typist alternates that many ticks of typing with as many
+// away from the keyboard, long enough for the scan to go idle, and the
+// time from the first press back to the full scan rate is printed.
+// Row edges while idle run PCINT0_vect, like the real interrupt.
+//
+// The time from each key press to the host's poll that collects its
+// report is always printed.  The polls come at the end of each frame,
+// just before the start of frame; -f moves the frames that many cycles
+// later against the scan, which otherwise starts in step with them.
+//
+// -l instead times building LED frames from lit grid cells, through the
+// old led_map_red() chain and through led_grid[], then the frames of
+// each lighting effect.
+//
+// The replay is one loop over the ticks, shared by every part of the
+// pipeline the bench follows: the typist, the press to poll time, idle
+// and wake, the lighting interrupts and the host's USB frames.  Each
+// of those keeps its own state and has its own steps in the tick and
+// its own lines of results, below, so one can be changed or added
+// without going through the others.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hal.h"
+#include "usb_keyboard.h"
+#include "keyboard.h"
+#include "matrix.h"
+#include "led.h"
+#include "lighting.h"
+#include "color.h"
+#include "keymap.h"
+#include "macro.h"
+#include "config.h"
+
+// led_chain.c
+extern uint8_t led_port[LED_MATRIX_OUT][3];
+uint8_t led_map_red(uint8_t x, uint8_t y);
+
+// USB frames are 1 ms
+#define FRAME_CYCLES	(F_CPU / 1000)
+
+#define KEYBOARD_EP	3
+
+static int verbose;
+
+// The replay's clock: the tick, and the CPU cycle count at the start of
+// this tick and of the last
+static unsigned long tick;
+static unsigned long long cycles, last;
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+	// xorshift32, so every build replays exactly the same typing
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+// CPU cycles between two timer 0 compare matches, as set up by
+// matrix_set_scan_rate()
+static unsigned long tick_cycles(void)
+{
+	static const uint8_t shift[] = {0, 3, 6, 8, 10};
+
+	return (unsigned long)(OCR0A + 1) << shift[(TCCR0B & 7) - 1];
+}
+
+static double elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// The typist.  Every few hundred ticks flip one random key of the
+// matrix, with at most a handful held down at once, roughly like fast
+// typing.  With -b the contact then reads randomly for a while before
+// it settles.
+
+// contact chatter after each flip, in ticks (-b), and the most keys
+// held down at once (-k)
+static unsigned bounce;
+static unsigned max_held = 4;
+
+// ticks of typing, then away (-q)
+static unsigned away;
+
+// set for the tick a key goes down, and which
+static int new_press;
+static uint8_t press_col, press_row;
+
+static void typist(void)
+{
+	static uint8_t held, col, row, settled;
+	static unsigned chatter;
+	uint32_t r;
+
+	if (away && (tick / away) & 1) {
+		memset(hal_host_keys, 0, sizeof(hal_host_keys));
+		held = 0;
+		chatter = 0;
+		return;
+	}
+	if (chatter) {
+		// random contact until the last tick, then the settled state
+		if (--chatter ? (rng() & 1) : settled)
+			hal_host_keys[col] |= 1 << row;
+		else
+			hal_host_keys[col] &= ~(1 << row);
+	}
+	if (tick % 97)
+		return;
+	r = rng();
+	col = r % KEY_MATRIX_IN;
+	row = (r >> 8) % KEY_MATRIX_OUT;
+	if (hal_host_keys[col] & (1 << row)) {
+		hal_host_keys[col] &= ~(1 << row);
+		settled = 0;
+		held--;
+	} else if (held < max_held) {
+		hal_host_keys[col] |= 1 << row;
+		settled = 1;
+		held++;
+		new_press = 1;
+		press_col = col;
+		press_row = row;
+	} else {
+		return;
+	}
+	chatter = bounce;
+}
+
+// Key press to the host's poll that collects the next keyboard report,
+// the press falling somewhere in the tick before the scan sees it.
+// Presses that leave the report alone (layer and macro keys) are not
+// counted.
+static uint8_t press_seen;
+static uint8_t report_nkro[KEYBOARD_NKRO_SIZE], report_mods;
+static unsigned long long press_cycle, poll_cycle;
+static unsigned long long poll_sum, poll_max;
+static unsigned long polls;
+
+static void collected(uint8_t ep, const uint8_t *buf, uint8_t len)
+{
+	unsigned long long t;
+	uint8_t i;
+
+	if (verbose) {
+		printf("%10lu ep%u:", tick, ep);
+		for (i = 0; i < len; i++)
+			printf(" %02x", buf[i]);
+		printf("\n");
+	}
+	if (ep == KEYBOARD_EP && press_cycle) {
+		t = poll_cycle - press_cycle;
+		poll_sum += t;
+		if (t > poll_max)
+			poll_max = t;
+		polls++;
+		press_cycle = 0;
+	}
+}
+
+// Before the scan: time a new press, and keep the report it may change
+static void poll_before_scan(void)
+{
+	if (new_press) {
+		// a fixed scatter over the tick, leaving rng() alone
+		press_cycle = last + 1 + (cycles > last ?
+			(tick * 2654435761UL >> 8) % (cycles - last) : 0);
+		new_press = 0;
+		press_seen = 0;
+	}
+	if (press_cycle && !press_seen) {
+		memcpy(report_nkro, keyboard_nkro_keys, sizeof(report_nkro));
+		report_mods = keyboard_modifier_keys;
+	}
+}
+
+// After the main loop: a press that got through the debounce but left
+// the report as it was is not timed
+static void poll_after_task(void)
+{
+	if (press_cycle && !press_seen &&
+	    (matrix_state[press_col] & (1 << press_row))) {
+		press_seen = 1;
+		if (keyboard_modifier_keys == report_mods &&
+		    !memcmp(keyboard_nkro_keys, report_nkro,
+		    sizeof(report_nkro)))
+			press_cycle = 0;
+	}
+}
+
+static void poll_results(void)
+{
+	printf("press to poll   %llu us, %llu us max\n",
+		polls ? poll_sum * 1000000 / F_CPU / polls : 0,
+		poll_max * 1000000 / F_CPU);
+}
+
+// Idle and wake (-q): the time from the first press after the scan
+// went idle to the scan seeing it.  Row edges while idle run
+// PCINT0_vect, like the real interrupt.
+static unsigned long long pressed, wake_sum, wake_max;
+static unsigned long idle_ticks, wakes;
+
+static int keys_down(void)
+{
+	uint8_t col;
+
+	for (col = 0; col < KEY_MATRIX_IN; col++)
+		if (hal_host_keys[col])
+			return 1;
+	return 0;
+}
+
+// a press has made it through the debounce to an event
+static int keys_seen(void)
+{
+	uint8_t col;
+
+	for (col = 0; col < KEY_MATRIX_IN; col++)
+		if (matrix_state[col])
+			return 1;
+	return 0;
+}
+
+static void wake_before_scan(void)
+{
+	if (!matrix_idle())
+		return;
+	idle_ticks++;
+	// the first press since going idle, taken to be just after the
+	// last tick
+	if (!pressed && keys_down())
+		pressed = last + 1;
+	if (hal_host_rows_wake && (~HAL_ROWS_READ() & 0x1F))
+		PCINT0_vect();
+}
+
+static void wake_after_scan(void)
+{
+	unsigned long long wake;
+
+	if (!pressed || !keys_seen())
+		return;
+	wake = cycles + 1 - pressed;
+	wake_sum += wake;
+	if (wake > wake_max)
+		wake_max = wake;
+	wakes++;
+	pressed = 0;
+}
+
+static void wake_results(void)
+{
+	printf("idle ticks      %lu\n", idle_ticks);
+	printf("press to event  %llu us, %llu us max, after %lu wakes\n",
+		wakes ? wake_sum * 1000000 / F_CPU / wakes : 0,
+		wake_max * 1000000 / F_CPU, wakes);
+}
+
+// Lighting (-m): the LED refresh and lighting interrupts, timers 1 and
+// 2 kept against the cycle count, their interrupts run as the count
+// passes each compare match
+static int lighting;
+static unsigned long long t1_next, t2_start, t2_next;
+
+#define T2_PERIOD	((unsigned long long)(OCR2A + 1) * 1024)
+
+static void lighting_start(uint8_t mode)
+{
+	lighting = 1;
+	led_init();
+	lighting_init();
+	lighting_set_mode(mode);
+	t1_next = OCR1A + 1;
+	t2_next = T2_PERIOD;
+}
+
+// The main loop, where a press may bring the next lighting frame
+// forward
+static void lighting_task(void)
+{
+	uint8_t t2count = TCNT2;
+
+	matrix_task();
+	if (TCNT2 != t2count)
+		t2_next = cycles + (OCR2A + 1 - TCNT2) * 1024ULL;
+}
+
+static void lighting_timers(void)
+{
+	while (t1_next <= cycles) {
+		TIMER1_COMPA_vect();
+		t1_next += OCR1A + 1;
+	}
+	while (t2_next <= cycles) {
+		t2_start = t2_next;
+		t2_next += T2_PERIOD;
+		TCNT2 = 0;
+		TIMER2_COMPA_vect();
+	}
+	TCNT2 = (cycles - t2_start) / 1024;
+}
+
+static void lighting_results(void)
+{
+	printf("lighting frames %lu, %u overruns\n",
+		(unsigned long)lighting_stats.frames, lighting_stats.overruns);
+	printf("press to light  %u us, %u us max\n",
+		lighting_stats.latency, lighting_stats.latency_max);
+}
+
+// The host: IN tokens every poll_interval frames (-i), at the end of
+// each frame, then the start of the next.  1 is what bInterval asks
+// for, more simulates a slow or busy host.  The frames start in step
+// with the scan, or -f cycles later.
+static unsigned poll_interval = 1;
+static unsigned long long next_frame = FRAME_CYCLES;
+
+static void usb_frames(void)
+{
+	unsigned long count;
+
+	while (cycles >= next_frame) {
+		poll_cycle = next_frame;
+		if (hal_host_frame % poll_interval == 0)
+			hal_host_in_tokens();
+		// timer 0 as the start of frame finds it, with the match
+		// pending if the tick has just ended
+		count = (next_frame - last) * (OCR0A + 1) / tick_cycles();
+		if (count > OCR0A) {
+			TIFR0 = 1 << OCF0A;
+			TCNT0 = 0;
+		} else {
+			TCNT0 = count;
+		}
+		usb_host_frame();
+		TIFR0 = 0;
+		TCNT0 = 0;
+		next_frame += FRAME_CYCLES;
+	}
+}
+
+// The replay: boot the firmware as main() does, then run the scan and
+// the main loop tick by tick, with each part of the bench in its place
+static int replay(unsigned long ticks, int protocol, int rate, int mode)
+{
+	struct timespec t0;
+	double secs;
+
+	hal_host_in_hook = collected;
+	usb_init();
+	usb_host_set_protocol(protocol);
+	keymap_init();
+	macro_init();
+	config_init();
+	matrix_init();
+	if (!matrix_set_scan_rate(rate)) {
+		fprintf(stderr, "scan rate %d out of range\n", rate);
+		return 1;
+	}
+	if (mode >= 0)
+		lighting_start(mode);
+	sei();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (tick = 0; tick < ticks; tick++) {
+		typist();
+		poll_before_scan();
+		wake_before_scan();
+		TIMER0_COMPA_vect();
+		wake_after_scan();
+		last = cycles;
+		if (lighting)
+			lighting_task();
+		else
+			matrix_task();
+		poll_after_task();
+		cycles += tick_cycles();
+		if (lighting)
+			lighting_timers();
+		usb_frames();
+	}
+	secs = elapsed(&t0);
+
+	printf("scan rate       %u Hz, %lu cycles per tick\n",
+		matrix_scan_rate(), tick_cycles());
+	printf("ticks           %lu\n", ticks);
+	printf("full scans      %lu\n", ticks / SCAN_TICKS_PER_PASS);
+	printf("reports         %lu\n", (unsigned long)hal_host_in_count);
+	printf("ns per tick     %.1f\n", secs * 1e9 / ticks);
+	printf("scans per sec   %.0f\n", ticks / SCAN_TICKS_PER_PASS / secs);
+	poll_results();
+	if (away)
+		wake_results();
+	if (lighting)
+		lighting_results();
+	return 0;
+}
+
+// Build frames from random grids with about half the cells lit: the
+// red port bytes through the chain, the port bytes of all three colors
+// through led_grid[], and full frames through led_set_cell() and
+// led_update().  The first two must agree on red.  Full frame and
+// effect times include a pass of the refresh interrupt.
+#define LED_PATTERNS	64
+
+// One full pass of the LED refresh, which takes up the frame
+// led_update() queued: an interrupt after each of planes 1 to 7 of
+// every cathode, plane 0 being lit by the one before plane 1
+static void led_refresh(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < LED_MATRIX_OUT * (LED_BCM_PLANES - 1); i++)
+		TIMER1_COMPA_vect();
+}
+
+static int led_map_bench(unsigned long frames)
+{
+	static uint8_t lit[LED_PATTERNS][LED_GRID_HEIGHT][LED_GRID_WIDTH];
+	uint8_t port[LED_MATRIX_OUT][3];
+	uint8_t x, y, c, cell, bit;
+	unsigned long f;
+	struct timespec t0;
+	double chain, table, full;
+	unsigned p;
+
+	for (p = 0; p < LED_PATTERNS; p++)
+		for (y = 0; y < LED_GRID_HEIGHT; y++)
+			for (x = 0; x < LED_GRID_WIDTH; x++)
+				lit[p][y][x] = rng() & 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (f = 0; f < frames; f++) {
+		memset(led_port, 0, sizeof(led_port));
+		for (y = 0; y < LED_GRID_HEIGHT; y++)
+			for (x = 0; x < LED_GRID_WIDTH; x++)
+				if (lit[f % LED_PATTERNS][y][x])
+					led_map_red(x, y);
+	}
+	chain = elapsed(&t0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (f = 0; f < frames; f++) {
+		memset(port, 0, sizeof(port));
+		for (y = 0; y < LED_GRID_HEIGHT; y++)
+			for (x = 0; x < LED_GRID_WIDTH; x++)
+				if (lit[f % LED_PATTERNS][y][x]) {
+					cell = led_cell(x, y);
+					bit = 1 << LED_CELL_ANODE(cell);
+					c = LED_CELL_CATHODE(cell);
+					port[c][RED] |= bit;
+					port[c][GREEN] |= bit;
+					port[c][BLUE] |= bit;
+				}
+	}
+	table = elapsed(&t0);
+
+	// same pattern as the last chain frame
+	for (c = 0; c < LED_MATRIX_OUT; c++) {
+		if (port[c][RED] != led_port[c][RED]) {
+			fprintf(stderr, "cathode %u: table %02x, chain %02x\n",
+				c, port[c][RED], led_port[c][RED]);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (f = 0; f < frames; f++) {
+		for (y = 0; y < LED_GRID_HEIGHT; y++)
+			for (x = 0; x < LED_GRID_WIDTH; x++)
+				if (lit[f % LED_PATTERNS][y][x])
+					led_set_cell(x, y, 0xFF, 0x80, 0x01);
+				else
+					led_set_cell(x, y, 0, 0, 0);
+		led_update();
+		led_refresh();
+	}
+	full = elapsed(&t0);
+
+	printf("frames          %lu\n", frames);
+	printf("ns chain        %.1f (red only)\n", chain * 1e9 / frames);
+	printf("ns table        %.1f\n", table * 1e9 / frames);
+	printf("ns set+update   %.1f\n", full * 1e9 / frames);
+	return 0;
+}
+
+// One pixel through HSV and the gamma curve, as led_update() sees it
+static void color_bench(unsigned long frames)
+{
+	uint8_t rgb[3];
+	unsigned long sum = 0;
+	unsigned long f;
+	struct timespec t0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (f = 0; f < frames * 100; f++) {
+		color_hsv(f, f >> 8, 255 - (f >> 16), rgb);
+		sum += color_gamma(rgb[RED]) + color_gamma(rgb[GREEN]) +
+			color_gamma(rgb[BLUE]);
+	}
+	printf("ns hsv+gamma    %.1f per pixel (%lu)\n",
+		elapsed(&t0) * 1e9 / (frames * 100), sum & 0xFF);
+}
+
+// Frames of each lighting effect, the first one being the effect's init
+static void effect_bench(unsigned long frames)
+{
+	unsigned long f;
+	struct timespec t0;
+	unsigned p;
+
+	for (p = 0; p < NUM_LMODES; p++) {
+		lighting_set_mode(p);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (f = 0; f < frames; f++) {
+			TIMER2_COMPA_vect();
+			led_refresh();
+		}
+		printf("ns effect %u     %.1f\n", p, elapsed(&t0) * 1e9 / frames);
+	}
+}
+
+static int led_bench(unsigned long frames)
+{
+	if (led_map_bench(frames))
+		return 1;
+	color_bench(frames);
+	effect_bench(frames);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long ticks = 10000000;
+	int opt, protocol = 1, rate = SCAN_RATE_HZ, leds = 0, mode = -1;
+
+	while ((opt = getopt(argc, argv, "vln:s:b:k:p:r:i:m:q:f:")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 'l': leds = 1; break;
+		case 'b': bounce = strtoul(optarg, NULL, 0) % 97; break;
+		case 'k': max_held = strtoul(optarg, NULL, 0); break;
+		case 'p': protocol = strtoul(optarg, NULL, 0); break;
+		case 'r': rate = strtoul(optarg, NULL, 0); break;
+		case 'i': poll_interval = strtoul(optarg, NULL, 0) ? : 1; break;
+		case 'm': mode = strtoul(optarg, NULL, 0); break;
+		case 'q': away = strtoul(optarg, NULL, 0); break;
+		case 'f':
+			next_frame += strtoul(optarg, NULL, 0) % FRAME_CYCLES;
+			break;
+		case 'n': ticks = strtoul(optarg, NULL, 0); break;
+		case 's': rng_state = strtoul(optarg, NULL, 0) | 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-v] [-l] [-n ticks] [-s seed] "
+				"[-b bounce] [-k max held] [-p protocol] "
+				"[-r scan rate] [-i poll interval] "
+				"[-m lighting mode] [-q ticks away] "
+				"[-f frame phase]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (leds)
+		return led_bench(ticks / 1000);
+	return replay(ticks, protocol, rate, mode);
+}
@@ -0,0 +1,435 @@
+// Native checks for behaviour the replay bench only shows as numbers.
+//
+// Each check boots the firmware against the simulated ports in
+// hal_host.c and drives it into one corner case, then reports ok or
+// FAILED.  Every check runs in its own child process, so it starts
+// from the firmware's power on state: zeroed statics and an erased
+// EEPROM.
+//
+//   rgb_keyboard_check [name ...]
+//
+// With no names every check runs; the exit status is the number that
+// failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "hal.h"
+#include "usb_keyboard.h"
+#include "keyboard.h"
+#include "matrix.h"
+#include "keymap.h"
+#include "macro.h"
+#include "config.h"
+#include "led.h"
+#include "editor.h"
+
+#define KEYBOARD_EP	3
+
+// scan ticks in a 1 ms USB frame at the default scan rate
+#define FRAME_TICKS	16
+
+static void boot(void)
+{
+	usb_init();
+	keymap_init();
+	macro_init();
+	config_init();
+	matrix_init();
+	sei();
+}
+
+// Runs the scan and the main loop for ms USB frames.  With tokens 0
+// the host stops polling, so reports stay in the endpoint banks.
+static void run_ms(uint16_t ms, uint8_t tokens)
+{
+	uint16_t i;
+
+	for (i = 0; i < ms * FRAME_TICKS; i++) {
+		TIMER0_COMPA_vect();
+		matrix_task();
+		if (i % FRAME_TICKS == FRAME_TICKS - 1) {
+			if (tokens)
+				hal_host_in_tokens();
+			usb_host_frame();
+		}
+	}
+}
+
+// Reports collected on the keyboard endpoint
+static uint8_t report_key(const uint8_t *buf, uint8_t key)
+{
+	return buf[1 + key / 8] & (1 << (key & 7));
+}
+
+// Whole taps of S, and whether A was ever reported
+static uint8_t taps_s, seen_a, held_s;
+
+static void tap_collected(uint8_t ep, const uint8_t *buf, uint8_t len)
+{
+	uint8_t s;
+
+	if (ep != KEYBOARD_EP)
+		return;
+	if (report_key(buf, KEY_A))
+		seen_a = 1;
+	s = report_key(buf, KEY_S);
+	if (s && !held_s)
+		taps_s++;
+	held_s = s;
+}
+
+// Taps a key on the default layout, 8 ms down and 8 ms up, with the
+// host not polling
+static void tap(uint8_t col, uint8_t row)
+{
+	hal_host_keys[col] |= 1 << row;
+	run_ms(8, 0);
+	hal_host_keys[col] &= ~(1 << row);
+	run_ms(8, 0);
+}
+
+// Taps made while the host stops polling fill the report queue;
+// none of them may be lost once it polls again.
+static int check_full_queue(void)
+{
+	uint8_t i;
+
+	hal_host_in_hook = tap_collected;
+	boot();
+	run_ms(20, 1);
+	for (i = 0; i < 4; i++)
+		tap(13, 2);
+	tap(14, 2);
+	run_ms(50, 1);
+	if (taps_s != 4 || !seen_a) {
+		printf("  %d of 4 taps of S, A %s\n", taps_s,
+			seen_a ? "seen" : "lost");
+		return 1;
+	}
+	return 0;
+}
+
+// The plane a refresh interrupt moved on to, from the compare value it
+// set: 2 to 7, or 1 when it started a cathode and lit plane 0 itself.
+// A late count is kept odd, so that a cathode's compare value, the
+// count plus 3 units less one, is even and never taken for a plane's.
+static uint8_t led_plane_set(void)
+{
+	uint8_t plane;
+
+	for (plane = 2; plane < LED_BCM_PLANES; plane++)
+		if (OCR1A == (LED_BCM_UNIT << plane) - 1)
+			return plane;
+	return 1;
+}
+
+// A refresh interrupt late by less than the shortest plane it has,
+// plane 2, may not skip a plane; one later still may never leave the
+// compare value below the count, where it would only match after the
+// counter wraps.
+static int check_late_plane(void)
+{
+	uint16_t i, late;
+	uint8_t plane = 1, next;
+
+	led_init();
+	for (i = 0; i < 4000; i++) {
+		if (i < 2000)
+			late = (i * 2 + 1) % (4 * LED_BCM_UNIT);
+		else
+			late = (i * 2654435761UL >> 16) % (64 * LED_BCM_UNIT);
+		TCNT1 = late;
+		TIMER1_COMPA_vect();
+		if (OCR1A < TCNT1) {
+			printf("  compare value %u below the count %u\n",
+				OCR1A, TCNT1);
+			return 1;
+		}
+		if (i >= 2000)
+			continue;
+		next = plane + 1 < LED_BCM_PLANES ? plane + 1 : 1;
+		plane = led_plane_set();
+		if (plane != next) {
+			printf("  %u cycles late: plane %u, not %u\n",
+				late, plane, next);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Runs the refresh interrupt on through n changes of cathode, and
+// returns the cathodes seen with their first red anode lit, one bit
+// each
+static uint16_t led_refresh(uint8_t n)
+{
+	uint16_t lit = 0;
+	uint8_t cathode = PORTA;
+
+	while (1) {
+		TCNT1 = 0;
+		TIMER1_COMPA_vect();
+		if (PORTA != cathode) {
+			if (!n--)
+				break;
+			cathode = PORTA;
+		}
+		if (PORTC & 1)
+			lit |= 1 << PORTA;
+	}
+	return lit;
+}
+
+// Every refresh shows one whole frame: a frame goes up only when the
+// refresh starts again from cathode 0, a frame encoded into the buffer
+// that came back from the refresh keeps the cathodes changed in the
+// frame before it, and a frame still waiting can be added to.
+static int check_frame_swap(void)
+{
+	static const struct {
+		uint8_t set;		// cathode lit, then led_update()
+		uint16_t lit[2];	// then in the next two refreshes
+	} steps[] = {
+		{ 3, { 0, 1 << 3 } },
+		{ 5, { 1 << 3, 1 << 3 | 1 << 5 } },
+		{ 7, { 0, 0 } },	// not refreshed before the next update
+		{ 1, { 1 << 3 | 1 << 5, 1 << 1 | 1 << 3 | 1 << 5 | 1 << 7 } },
+	};
+	uint8_t i, j;
+	uint16_t lit;
+
+	led_init();
+	led_refresh(LED_MATRIX_OUT - 1);
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		led_set(steps[i].set, 0, 255, 0, 0);
+		led_update();
+		if (!steps[i].lit[1])
+			continue;
+		for (j = 0; j < 2; j++) {
+			lit = led_refresh(LED_MATRIX_OUT - 1);
+			if (lit != steps[i].lit[j]) {
+				printf("  after cathode %u: lit %03x, "
+					"not %03x\n", steps[i].set, lit,
+					steps[i].lit[j]);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// A key press or release on row 0 straight to the keymap, and whether
+// a keycode is in the report
+static void key_event(uint8_t col, uint8_t pressed)
+{
+	keymap_event(MATRIX_EVENT(col, 0, pressed));
+}
+
+static uint8_t key_reported(uint8_t key)
+{
+	return keyboard_nkro_keys[key / 8] & (1 << (key & 7));
+}
+
+// Layers and shared entries: a key releases what it was pressed as,
+// whatever the layers are by then; a transparent entry falls through;
+// and of two keys with the same modifier or keycode, releasing one
+// leaves it down while the other is held.
+static int check_layers(void)
+{
+	static const struct {
+		uint8_t col, pressed;
+		uint8_t mods;		// keyboard_modifier_keys after
+		uint8_t key, down;	// and that keycode in the report or not
+	} steps[] = {
+		{ 0, 1, KM_MOD_BIT(KM_LSHIFT), 0, 0 },
+		{ 1, 1, KM_MOD_BIT(KM_LSHIFT), 0, 0 },
+		{ 0, 0, KM_MOD_BIT(KM_LSHIFT), 0, 0 },	// the other holds it
+		{ 1, 0, 0, 0, 0 },
+		{ 2, 1, 0, 0, 0 },			// layer 1 on
+		{ 3, 1, 0, KEY_B, 1 },
+		{ 4, 1, 0, KEY_C, 1 },			// through to layer 0
+		{ 2, 0, 0, KEY_B, 1 },			// layer 1 off
+		{ 3, 0, 0, KEY_B, 0 },
+		{ 4, 0, 0, KEY_C, 0 },
+		{ 3, 1, 0, KEY_A, 1 },
+		{ 5, 1, 0, KEY_A, 1 },
+		{ 3, 0, 0, KEY_A, 1 },			// the other holds it
+		{ 5, 0, 0, KEY_A, 0 },
+	};
+	uint8_t i;
+
+	keymap_init();
+	keymap_set(0, 0, 0, KM_LSHIFT);
+	keymap_set(0, 1, 0, KM_LSHIFT);
+	keymap_set(0, 2, 0, KM_MO(1));
+	keymap_set(0, 3, 0, KEY_A);
+	keymap_set(1, 3, 0, KEY_B);
+	keymap_set(0, 4, 0, KEY_C);
+	keymap_set(1, 4, 0, KM_TRNS);
+	keymap_set(0, 5, 0, KEY_A);
+	keymap_set(1, 5, 0, KM_TRNS);
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		key_event(steps[i].col, steps[i].pressed);
+		if (keyboard_modifier_keys != steps[i].mods ||
+		    (steps[i].key &&
+		     !key_reported(steps[i].key) != !steps[i].down)) {
+			printf("  step %u: column %u %s\n", i, steps[i].col,
+				steps[i].pressed ? "pressed" : "released");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Saves what is in the settings now, to the end
+static void config_save_all(void)
+{
+	config_save();
+	do
+		config_task();
+	while (config_busy());
+}
+
+// A save cut short at any byte, as by the power going, leaves the
+// previous save to load at the next boot, and only the whole save
+// replaces it.  The saves before it go round all the slots, so the cut
+// one overwrites an old record.  Every cut is made in a child process,
+// from the same EEPROM.
+static int check_power_cut(void)
+{
+	uint16_t n, i;
+	uint8_t done;
+	pid_t pid;
+	int status;
+
+	keymap_init();
+	config_init();
+	keymap_set(0, 0, 0, KEY_A);
+	for (i = 0; i < (E2END + 1) / 128 + 1; i++)
+		config_save_all();
+	keymap_set(0, 0, 0, KEY_B);
+	for (n = 0; ; n++) {
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			config_save();
+			for (i = 0; i < n && config_busy(); i++)
+				config_task();
+			done = !config_busy();
+			keymap_set(0, 0, 0, KEY_C);
+			config_init();
+			if (key_map(0, 0, 0) != (done ? KEY_B : KEY_A)) {
+				printf("  cut after %u bytes: keycode %u\n",
+					n, key_map(0, 0, 0));
+				exit(2);
+			}
+			exit(done);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) > 1)
+			return 1;
+		if (WEXITSTATUS(status))
+			return 0;
+	}
+}
+
+// A one byte write to the first recorded macro byte, in a batch of its
+// own, returns the batch's status
+static uint8_t macro_write(uint8_t b)
+{
+	uint8_t packet[RAWHID_RX_SIZE] = {
+		EDITOR_WRITE, EDITOR_MACROS, 0, 0, 1, EDITOR_ACK, b
+	};
+
+	hal_host_out_packet(2, packet, sizeof(packet));
+	editor_task();
+	hal_host_in_tokens();
+	return hal_host_in_last[5];
+}
+
+// The recorded macros can be written over the configuration interface,
+// but not while one of them plays, which would read them half written
+static int check_macro_busy(void)
+{
+	uint8_t b, status;
+
+	usb_init();
+	keymap_init();
+	macro_init();
+	b = macro_user[0];
+	status = macro_write(b);
+	if (status != EDITOR_OK) {
+		printf("  idle: status %u\n", status);
+		return 1;
+	}
+	macro_key(KM_PLAY(0), 1);
+	status = macro_write(b ^ 0xFF);
+	if (!macro_playing() || status != EDITOR_BUSY ||
+	    macro_user[0] != b) {
+		printf("  playing: status %u\n", status);
+		return 1;
+	}
+	return 0;
+}
+
+static const struct check {
+	const char *name;
+	int (*run)(void);
+} checks[] = {
+	{ "full_queue", check_full_queue },
+	{ "late_plane", check_late_plane },
+	{ "frame_swap", check_frame_swap },
+	{ "layers", check_layers },
+	{ "power_cut", check_power_cut },
+	{ "macro_busy", check_macro_busy },
+};
+
+#define NUM_CHECKS	(sizeof(checks) / sizeof(checks[0]))
+
+static int run_check(const struct check *c)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0)
+		exit(c->run());
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		printf("%s FAILED\n", c->name);
+		return 1;
+	}
+	printf("%s ok\n", c->name);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int n, failed = 0;
+
+	if (argc == 1) {
+		for (i = 0; i < NUM_CHECKS; i++)
+			failed += run_check(&checks[i]);
+		return failed;
+	}
+	for (n = 1; n < argc; n++) {
+		for (i = 0; i < NUM_CHECKS; i++)
+			if (!strcmp(argv[n], checks[i].name))
+				break;
+		if (i == NUM_CHECKS) {
+			fprintf(stderr, "no check %s\n", argv[n]);
+			return 1;
+		}
+		failed += run_check(&checks[i]);
+	}
+	return failed;
+}
@@ -0,0 +1,572 @@
+// Host side of the configuration protocol, see editor.h.
+//
+// Talks to the keyboard through Linux hidraw, finding the vendor
+// defined interface by its VID/PID and usage page.  Built with
+// CONFIG_TOOL_LOOPBACK (make host) it is linked with the firmware
+// instead, and drives editor_task() through the simulated endpoints in
+// hal_host.c one 1 ms USB frame at a time, so the protocol can be run
+// without a keyboard and uploads timed in frames.
+//
+//   rgb_keyboard_config [-d /dev/hidrawN] command ...
+//     info                    protocol and table sizes
+//     keymap                  print the keymap, a matrix row per line
+//     load FILE               upload a keymap in that format ("-" stdin)
+//     key LAYER COL ROW CODE  change one key
+//     mode N                  lighting mode
+//     color R G B             lighting color
+//     rate HZ                 full matrix scans per second
+//     stats                   lighting frame and latency counters, the
+//                             scan rate and load, and debug output lost
+//     save                    save to EEPROM now
+//     isr                     interrupt timings, from an ISR_STATS build
+//     isr-clear               start them over
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "usb_keyboard.h"
+#include "editor.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "macro.h"
+#include "lighting.h"
+#include "matrix.h"
+#include "isr_stats.h"
+
+#define VENDOR_ID	0x16C0
+#define PRODUCT_ID	0x047C
+#define USAGE_PAGE	0xFFAB
+
+#define TIMEOUT_MS	1000
+
+static uint16_t crc16_update(uint16_t crc, uint8_t a)
+{
+	int i;
+
+	crc ^= a;
+	for (i = 0; i < 8; ++i)
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	return crc;
+}
+
+#ifdef CONFIG_TOOL_LOOPBACK
+#include "hal.h"
+#include "config.h"
+
+static uint8_t in_packet[RAWHID_TX_SIZE];
+static int in_ready;
+static unsigned long frames;
+
+static void in_hook(uint8_t ep, const uint8_t *buf, uint8_t len)
+{
+	if (ep != 1)
+		return;
+	memcpy(in_packet, buf, len);
+	in_ready = 1;
+}
+
+// one USB frame: the main loop runs a few times, then the host polls
+static void frame(void)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		editor_task();
+		config_task();
+	}
+	hal_host_in_tokens();
+	usb_host_frame();
+	frames++;
+}
+
+static int dev_open(const char *path)
+{
+	hal_host_in_hook = in_hook;
+	usb_init();
+	keymap_init();
+	macro_init();
+	config_init();
+	return 0;
+}
+
+static int dev_send(const uint8_t *buf)
+{
+	int t;
+
+	for (t = 0; t < TIMEOUT_MS; t++) {
+		if (hal_host_out_packet(2, buf, RAWHID_RX_SIZE))
+			return 0;
+		frame();
+	}
+	return -1;
+}
+
+static int dev_recv(uint8_t *buf)
+{
+	int t;
+
+	for (t = 0; t < TIMEOUT_MS; t++) {
+		frame();
+		if (in_ready) {
+			memcpy(buf, in_packet, RAWHID_TX_SIZE);
+			in_ready = 0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static unsigned long dev_ms(void)
+{
+	return frames;
+}
+
+// there is no control endpoint in the simulation
+static int dev_feature(uint8_t *buf, int len, int set)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+static void dev_close(void)
+{
+	// let a save run to the end
+	while (config_busy())
+		frame();
+}
+
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+static int fd = -1;
+
+// the report descriptor starts with our usage page
+static int is_config_interface(const char *name)
+{
+	char path[300], line[256];
+	unsigned int bus, vid, pid;
+	uint8_t desc[3];
+	FILE *f;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", name);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vid, &pid) == 3 &&
+		    vid == VENDOR_ID && pid == PRODUCT_ID)
+			found = 1;
+	}
+	fclose(f);
+	if (!found)
+		return 0;
+	snprintf(path, sizeof(path),
+		"/sys/class/hidraw/%s/device/report_descriptor", name);
+	if (!(f = fopen(path, "rb")))
+		return 0;
+	found = fread(desc, 1, 3, f) == 3 && desc[0] == 0x06 &&
+		desc[1] == (USAGE_PAGE & 0xFF) && desc[2] == USAGE_PAGE >> 8;
+	fclose(f);
+	return found;
+}
+
+static int dev_open(const char *path)
+{
+	char dev[300];
+	struct dirent *d;
+	DIR *dir;
+
+	if (!path) {
+		if (!(dir = opendir("/sys/class/hidraw")))
+			return -1;
+		while ((d = readdir(dir))) {
+			if (strncmp(d->d_name, "hidraw", 6) ||
+			    !is_config_interface(d->d_name))
+				continue;
+			snprintf(dev, sizeof(dev), "/dev/%s", d->d_name);
+			path = dev;
+			break;
+		}
+		closedir(dir);
+		if (!path) {
+			errno = ENODEV;
+			return -1;
+		}
+	}
+	fd = open(path, O_RDWR);
+	return fd < 0 ? -1 : 0;
+}
+
+// hidraw takes the report number first, 0 as there are none
+static int dev_send(const uint8_t *buf)
+{
+	uint8_t report[RAWHID_RX_SIZE + 1];
+
+	report[0] = 0;
+	memcpy(report + 1, buf, RAWHID_RX_SIZE);
+	return write(fd, report, sizeof(report)) == sizeof(report) ? 0 : -1;
+}
+
+static int dev_recv(uint8_t *buf)
+{
+	struct pollfd p = {fd, POLLIN, 0};
+
+	if (poll(&p, 1, TIMEOUT_MS) <= 0)
+		return -1;
+	return read(fd, buf, RAWHID_TX_SIZE) == RAWHID_TX_SIZE ? 0 : -1;
+}
+
+// feature reports, again with the report number first
+static int dev_feature(uint8_t *buf, int len, int set)
+{
+	uint8_t report[256];
+
+	report[0] = 0;
+	memcpy(report + 1, buf, len);
+	if (ioctl(fd, set ? HIDIOCSFEATURE(len + 1) : HIDIOCGFEATURE(len + 1),
+	    report) < 0)
+		return -1;
+	memcpy(buf, report + 1, len);
+	return 0;
+}
+
+static unsigned long dev_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000UL + t.tv_nsec / 1000000;
+}
+
+static void dev_close(void)
+{
+	close(fd);
+}
+#endif
+
+static void packet(uint8_t *buf, uint8_t cmd, uint8_t table, uint16_t offset,
+	uint8_t len, uint8_t flags)
+{
+	memset(buf, 0, RAWHID_RX_SIZE);
+	buf[0] = cmd;
+	buf[1] = table;
+	buf[2] = offset;
+	buf[3] = offset >> 8;
+	buf[4] = len;
+	buf[5] = flags;
+}
+
+static int transact(uint8_t *req, uint8_t *reply)
+{
+	if (dev_send(req) || dev_recv(reply)) {
+		fprintf(stderr, "no reply from the keyboard\n");
+		return -1;
+	}
+	if (reply[5] != EDITOR_OK) {
+		fprintf(stderr, "command %02x failed, status %u\n", req[0], reply[5]);
+		return -1;
+	}
+	return 0;
+}
+
+static int table_read(uint8_t table, uint8_t *data, uint16_t size)
+{
+	uint8_t req[RAWHID_RX_SIZE], reply[RAWHID_TX_SIZE];
+	uint16_t offset;
+	uint8_t len;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = size - offset < EDITOR_DATA_SIZE ? size - offset : EDITOR_DATA_SIZE;
+		packet(req, EDITOR_READ, table, offset, len, 0);
+		if (transact(req, reply))
+			return -1;
+		memcpy(data + offset, reply + EDITOR_HEADER_SIZE, len);
+	}
+	return 0;
+}
+
+// all of it in one batch, checked against the one acknowledgement
+static int table_write(uint8_t table, uint16_t start, const uint8_t *data,
+	uint16_t size)
+{
+	uint8_t req[RAWHID_RX_SIZE], reply[RAWHID_TX_SIZE];
+	uint16_t i, offset, crc = 0xFFFF;
+	unsigned long start_ms = dev_ms();
+	uint8_t len;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = size - offset < EDITOR_DATA_SIZE ? size - offset : EDITOR_DATA_SIZE;
+		packet(req, EDITOR_WRITE, table, start + offset, len,
+			offset + len >= size ? EDITOR_ACK : 0);
+		memcpy(req + EDITOR_HEADER_SIZE, data + offset, len);
+		if (offset + len < size && dev_send(req)) {
+			fprintf(stderr, "keyboard not accepting data\n");
+			return -1;
+		}
+	}
+	if (transact(req, reply))
+		return -1;
+	for (i = 0; i < size; i++)
+		crc = crc16_update(crc, data[i]);
+	if ((reply[2] | reply[3] << 8) != size ||
+	    (reply[6] | reply[7] << 8) != crc) {
+		fprintf(stderr, "upload did not check: %u bytes, crc %04x\n",
+			reply[2] | reply[3] << 8, reply[6] | reply[7] << 8);
+		return -1;
+	}
+	if (size > EDITOR_DATA_SIZE)
+		fprintf(stderr, "%u bytes in %lu ms\n", size, dev_ms() - start_ms);
+	return 0;
+}
+
+static int cmd_info(void)
+{
+	uint8_t req[RAWHID_RX_SIZE], reply[RAWHID_TX_SIZE];
+	uint8_t i, n, *p;
+
+	packet(req, EDITOR_INFO, 0, 0, 0, 0);
+	if (transact(req, reply))
+		return -1;
+	p = reply + EDITOR_HEADER_SIZE;
+	n = p[1];
+	printf("protocol %u, %u tables\n", p[0], n);
+	for (i = 0, p += 2; i < n; i++, p += 3)
+		printf("table %u: %u bytes%s\n", i, p[0] | p[1] << 8,
+			p[2] ? "" : ", read only");
+	return 0;
+}
+
+static int cmd_keymap(void)
+{
+	uint8_t map[KEYMAP_LAYERS][KEY_MATRIX_OUT][KEY_MATRIX_IN];
+	int l, r, c;
+
+	if (table_read(EDITOR_KEYMAP, &map[0][0][0], sizeof(map)))
+		return -1;
+	for (l = 0; l < KEYMAP_LAYERS; l++) {
+		printf("# layer %d\n", l);
+		for (r = 0; r < KEY_MATRIX_OUT; r++) {
+			for (c = 0; c < KEY_MATRIX_IN; c++)
+				printf("%s%02x", c ? " " : "", map[l][r][c]);
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+static int cmd_load(const char *name)
+{
+	uint8_t map[KEYMAP_LAYERS * KEY_MATRIX_OUT * KEY_MATRIX_IN];
+	char line[256], *p, *end;
+	unsigned long v;
+	size_t n = 0;
+	FILE *f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	while (n < sizeof(map) && fgets(line, sizeof(line), f)) {
+		if ((p = strchr(line, '#')))
+			*p = 0;
+		for (p = line; n < sizeof(map); p = end) {
+			v = strtoul(p, &end, 16);
+			if (end == p)
+				break;
+			map[n++] = v;
+		}
+	}
+	if (f != stdin)
+		fclose(f);
+	if (n != sizeof(map)) {
+		fprintf(stderr, "%s: %zu of %zu keys\n", name, n, sizeof(map));
+		return -1;
+	}
+	return table_write(EDITOR_KEYMAP, 0, map, sizeof(map));
+}
+
+static int cmd_key(char **argv)
+{
+	uint8_t l = atoi(argv[0]), c = atoi(argv[1]), r = atoi(argv[2]);
+	uint8_t code = strtoul(argv[3], NULL, 0);
+
+	if (l >= KEYMAP_LAYERS || r >= KEY_MATRIX_OUT || c >= KEY_MATRIX_IN) {
+		fprintf(stderr, "no such key\n");
+		return -1;
+	}
+	return table_write(EDITOR_KEYMAP,
+		(l * KEY_MATRIX_OUT + r) * KEY_MATRIX_IN + c, &code, 1);
+}
+
+static int cmd_lighting(uint8_t mode, const uint8_t *color)
+{
+	struct lighting_config lc;
+
+	if (table_read(EDITOR_LIGHTING, (uint8_t *)&lc, sizeof(lc)))
+		return -1;
+	if (color)
+		memcpy(lc.color, color, sizeof(lc.color));
+	else
+		lc.mode = mode;
+	return table_write(EDITOR_LIGHTING, 0, (uint8_t *)&lc, sizeof(lc));
+}
+
+static int cmd_rate(uint16_t hz)
+{
+	struct matrix_config mc = {.scan_rate = hz};
+
+	return table_write(EDITOR_SCAN, 0, (uint8_t *)&mc, sizeof(mc));
+}
+
+static int cmd_stats(void)
+{
+	struct lighting_stats s;
+	struct matrix_stats ms;
+	uint8_t dropped[2];
+
+	if (table_read(EDITOR_STATS, (uint8_t *)&s, sizeof(s)) ||
+	    table_read(EDITOR_SCAN_STATS, (uint8_t *)&ms, sizeof(ms)) ||
+	    table_read(EDITOR_DEBUG, dropped, sizeof(dropped)))
+		return -1;
+	printf("scan rate       %u Hz%s\n", ms.scan_rate,
+		ms.idle ? ", idle" : "");
+	printf("scan load       %u%%\n", ms.load);
+	printf("frames          %lu\n", (unsigned long)s.frames);
+	printf("overruns        %u\n", s.overruns);
+	printf("frame max       %u us\n", s.max * 64);
+	printf("latency max     %u us\n", s.latency_max);
+	printf("debug dropped   %u bytes\n", dropped[0] | dropped[1] << 8);
+	return 0;
+}
+
+static int cmd_save(void)
+{
+	uint8_t req[RAWHID_RX_SIZE], reply[RAWHID_TX_SIZE];
+
+	packet(req, EDITOR_SAVE, 0, 0, 0, 0);
+	return transact(req, reply);
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static int cmd_isr(int clear)
+{
+	static const char *names[ISR_STATS_COUNT] = {
+		"scan", "led", "lighting", "usb_gen", "usb_com"
+	};
+	uint8_t r[ISR_STATS_REPORT_SIZE], *p;
+	int i, b;
+
+	memset(r, 0, sizeof(r));
+	if (dev_feature(r, sizeof(r), clear)) {
+		perror("interrupt timings (ISR_STATS build?)");
+		return -1;
+	}
+	if (clear)
+		return 0;
+	if (r[0] != ISR_STATS_VERSION || r[1] != ISR_STATS_COUNT) {
+		fprintf(stderr, "unknown interrupt timings version\n");
+		return -1;
+	}
+	printf("instrumentation %u cycles per sample, %u added per interrupt\n",
+		le16(r + 2), le16(r + 4));
+	printf("%-9s %10s %6s %6s %6s %6s  log2 histogram\n",
+		"", "runs", "min", "max", "late", ">late");
+	for (i = 0; i < ISR_STATS_COUNT; i++) {
+		p = r + 6 + i * ISR_STATS_ENTRY_SIZE;
+		printf("%-9s %10lu %6u %6u %6u %6u ", names[i],
+			(unsigned long)(le16(p) | (uint32_t)le16(p + 2) << 16),
+			le16(p) | le16(p + 2) ? le16(p + 4) : 0,
+			le16(p + 6), le16(p + 8), le16(p + 10));
+		for (b = 0; b < ISR_STATS_BUCKETS; b++)
+			printf(" %u", le16(p + 12 + 2 * b));
+		printf("\n");
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: rgb_keyboard_config [-d /dev/hidrawN] "
+		"info | keymap | load FILE | key LAYER COL ROW CODE |\n"
+		"       mode N | color R G B | rate HZ | stats | save | isr |\n"
+		"       isr-clear ...\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	uint8_t color[3];
+	int opt, err = 0;
+
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		switch (opt) {
+		case 'd': path = optarg; break;
+		default: usage();
+		}
+	}
+	argv += optind;
+	if (!*argv)
+		usage();
+	if (dev_open(path)) {
+		perror(path ? path : "keyboard");
+		return 1;
+	}
+
+	// commands run in turn, so a tool invocation can load then save
+	while (*argv && !err) {
+		if (!strcmp(*argv, "info")) {
+			err = cmd_info();
+			argv += 1;
+		} else if (!strcmp(*argv, "keymap")) {
+			err = cmd_keymap();
+			argv += 1;
+		} else if (!strcmp(*argv, "load") && argv[1]) {
+			err = cmd_load(argv[1]);
+			argv += 2;
+		} else if (!strcmp(*argv, "key") && argv[1] && argv[2] &&
+			   argv[3] && argv[4]) {
+			err = cmd_key(argv + 1);
+			argv += 5;
+		} else if (!strcmp(*argv, "mode") && argv[1]) {
+			err = cmd_lighting(atoi(argv[1]), NULL);
+			argv += 2;
+		} else if (!strcmp(*argv, "color") && argv[1] && argv[2] && argv[3]) {
+			color[0] = strtoul(argv[1], NULL, 0);
+			color[1] = strtoul(argv[2], NULL, 0);
+			color[2] = strtoul(argv[3], NULL, 0);
+			err = cmd_lighting(0, color);
+			argv += 4;
+		} else if (!strcmp(*argv, "rate") && argv[1]) {
+			err = cmd_rate(atoi(argv[1]));
+			argv += 2;
+		} else if (!strcmp(*argv, "stats")) {
+			err = cmd_stats();
+			argv += 1;
+		} else if (!strcmp(*argv, "save")) {
+			err = cmd_save();
+			argv += 1;
+		} else if (!strcmp(*argv, "isr")) {
+			err = cmd_isr(0);
+			argv += 1;
+		} else if (!strcmp(*argv, "isr-clear")) {
+			err = cmd_isr(1);
+			argv += 1;
+		} else {
+			usage();
+		}
+	}
+	dev_close();
+	return err ? 1 : 0;
+}
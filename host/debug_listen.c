@@ -0,0 +1,109 @@
+// Prints the keyboard's debug output, the hid_listen protocol on its
+// HID debug interface (usage page 0xFF31), read through Linux hidraw.
+// Waits for the keyboard, and for it again after it goes away.
+//
+//   rgb_keyboard_listen [-d /dev/hidrawN]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#define VENDOR_ID	0x16C0
+#define PRODUCT_ID	0x047C
+#define USAGE_PAGE	0xFF31
+#define DEBUG_TX_SIZE	32
+
+// the report descriptor starts with the debug usage page
+static int is_debug_interface(const char *name)
+{
+	char path[300], line[256];
+	unsigned int bus, vid, pid;
+	uint8_t desc[3];
+	FILE *f;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", name);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vid, &pid) == 3 &&
+		    vid == VENDOR_ID && pid == PRODUCT_ID)
+			found = 1;
+	}
+	fclose(f);
+	if (!found)
+		return 0;
+	snprintf(path, sizeof(path),
+		"/sys/class/hidraw/%s/device/report_descriptor", name);
+	if (!(f = fopen(path, "rb")))
+		return 0;
+	found = fread(desc, 1, 3, f) == 3 && desc[0] == 0x06 &&
+		desc[1] == (USAGE_PAGE & 0xFF) && desc[2] == USAGE_PAGE >> 8;
+	fclose(f);
+	return found;
+}
+
+static int find(char *dev, size_t size)
+{
+	struct dirent *d;
+	DIR *dir;
+	int found = 0;
+
+	if (!(dir = opendir("/sys/class/hidraw")))
+		return 0;
+	while (!found && (d = readdir(dir))) {
+		if (strncmp(d->d_name, "hidraw", 6) ||
+		    !is_debug_interface(d->d_name))
+			continue;
+		snprintf(dev, size, "/dev/%s", d->d_name);
+		found = 1;
+	}
+	closedir(dir);
+	return found;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t buf[DEBUG_TX_SIZE];
+	char dev[300];
+	const char *path = NULL;
+	int opt, fd, n, i, waiting = 0;
+
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		switch (opt) {
+		case 'd': path = optarg; break;
+		default:
+			fprintf(stderr, "usage: rgb_keyboard_listen [-d /dev/hidrawN]\n");
+			return 2;
+		}
+	}
+
+	while (1) {
+		if (path)
+			snprintf(dev, sizeof(dev), "%s", path);
+		if ((!path && !find(dev, sizeof(dev))) ||
+		    (fd = open(dev, O_RDONLY)) < 0) {
+			if (!waiting)
+				fprintf(stderr, "Waiting for device:");
+			waiting = 1;
+			sleep(1);
+			continue;
+		}
+		fprintf(stderr, "%sListening on %s\n", waiting ? "\n" : "", dev);
+		waiting = 0;
+		while ((n = read(fd, buf, sizeof(buf))) > 0) {
+			// packets are padded with zeros
+			for (i = 0; i < n; i++) {
+				if (buf[i])
+					putchar(buf[i]);
+			}
+			fflush(stdout);
+		}
+		close(fd);
+		fprintf(stderr, "Device disconnected.\n");
+	}
+}
@@ -0,0 +1,138 @@
+// Simulated ports and captured IN endpoint for the native build.
+
+#include <string.h>
+#include "hal.h"
+
+volatile uint8_t SREG;
+volatile uint8_t PORTB, DDRB;
+volatile uint8_t PORTE, DDRE;
+volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK0, TCNT0, TIFR0;
+volatile uint8_t PORTA, PORTC, PORTD, PORTF;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t OCR1A, TCNT1;
+volatile uint8_t TCCR2A, TCCR2B, OCR2A, TIMSK2, TCNT2, TIFR2;
+
+uint8_t hal_host_keys[HAL_HOST_COLUMNS];
+volatile uint8_t hal_host_rows_wake;
+
+// erased
+uint8_t hal_host_eeprom[E2END + 1] = {[0 ... E2END] = 0xFF};
+
+uint8_t hal_host_ep;
+volatile uint8_t hal_host_frame;
+
+void (*hal_host_in_hook)(uint8_t ep, const uint8_t *buf, uint8_t len);
+uint8_t hal_host_in_last[HAL_HOST_EP_SIZE];
+uint8_t hal_host_in_last_len;
+uint32_t hal_host_in_count;
+
+static struct {
+	uint8_t data[2][HAL_HOST_EP_SIZE];
+	uint8_t len[2];
+	uint8_t first;		// oldest released bank
+	uint8_t count;		// banks released and not yet collected
+	uint8_t fill;		// bytes written to the bank being filled
+	uint8_t out;		// host to device, skipped by IN tokens
+} ep[HAL_HOST_ENDPOINTS];
+
+// rows 0:2 are PINB 4:6, rows 3:4 are PINE 6:7, all pulled up
+uint8_t hal_host_pinb(void)
+{
+	uint8_t down = hal_host_keys[PORTB & 0x0F];
+
+	return 0x70 & ~((down & 0x07) << 4);
+}
+
+uint8_t hal_host_pine(void)
+{
+	uint8_t down = hal_host_keys[PORTB & 0x0F];
+
+	return 0xC0 & ~((down & 0x18) << 3);
+}
+
+uint8_t hal_host_ep_writable(void)
+{
+	return ep[hal_host_ep].count < 2;
+}
+
+void hal_host_ep_write(uint8_t b)
+{
+	uint8_t n = hal_host_ep;
+	uint8_t bank = (ep[n].first + ep[n].count) & 1;
+
+	if (ep[n].count < 2 && ep[n].fill < HAL_HOST_EP_SIZE)
+		ep[n].data[bank][ep[n].fill++] = b;
+}
+
+void hal_host_ep_release(void)
+{
+	uint8_t n = hal_host_ep;
+
+	if (ep[n].count < 2) {
+		ep[n].len[(ep[n].first + ep[n].count) & 1] = ep[n].fill;
+		ep[n].count++;
+	}
+	ep[n].fill = 0;
+}
+
+// OUT endpoints share the two banks: the host fills them and the
+// firmware reads the oldest, with fill as its read position
+uint8_t hal_host_ep_readable(void)
+{
+	return ep[hal_host_ep].count > 0;
+}
+
+uint8_t hal_host_ep_read(void)
+{
+	uint8_t n = hal_host_ep;
+
+	if (!ep[n].count || ep[n].fill >= ep[n].len[ep[n].first])
+		return 0;
+	return ep[n].data[ep[n].first][ep[n].fill++];
+}
+
+void hal_host_ep_release_out(void)
+{
+	uint8_t n = hal_host_ep;
+
+	if (ep[n].count) {
+		ep[n].first ^= 1;
+		ep[n].count--;
+	}
+	ep[n].fill = 0;
+}
+
+// the host sends a packet to an OUT endpoint, NAKed while both banks
+// are full (returns 0)
+uint8_t hal_host_out_packet(uint8_t n, const uint8_t *buf, uint8_t len)
+{
+	uint8_t bank;
+
+	if (ep[n].count >= 2)
+		return 0;
+	bank = (ep[n].first + ep[n].count) & 1;
+	memcpy(ep[n].data[bank], buf, len);
+	ep[n].len[bank] = len;
+	ep[n].count++;
+	ep[n].out = 1;
+	return 1;
+}
+
+// the host polls every endpoint, collecting one packet from each
+void hal_host_in_tokens(void)
+{
+	uint8_t n, bank;
+
+	for (n = 1; n < HAL_HOST_ENDPOINTS; n++) {
+		if (!ep[n].count || ep[n].out)
+			continue;
+		bank = ep[n].first;
+		memcpy(hal_host_in_last, ep[n].data[bank], ep[n].len[bank]);
+		hal_host_in_last_len = ep[n].len[bank];
+		hal_host_in_count++;
+		if (hal_host_in_hook)
+			hal_host_in_hook(n, ep[n].data[bank], ep[n].len[bank]);
+		ep[n].first ^= 1;
+		ep[n].count--;
+	}
+}
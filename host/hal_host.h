@@ -0,0 +1,152 @@
+#ifndef hal_host_h__
+#define hal_host_h__
+
+// Native stand-ins for the AVR registers and avr-libc macros used by
+// the scan, keymap and report code.  Only included through hal.h when
+// HOST_BUILD is defined.
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr)	(*(const uint8_t *)(addr))
+#define pgm_read_word(addr)	(*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr)	(*(void * const *)(addr))
+#define memcpy_P(dst, src, n)	memcpy(dst, src, n)
+#define PSTR(s)			(s)
+
+#define ISR(vector, ...)	void vector(void)
+#define ISR_NOBLOCK
+#define cli()			(SREG &= ~0x80)
+#define sei()			(SREG |= 0x80)
+
+extern volatile uint8_t SREG;
+extern volatile uint8_t PORTB, DDRB;
+extern volatile uint8_t PORTE, DDRE;
+
+// Timer 0; the counter does not run, it holds whatever the caller
+// sets it to
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK0, TCNT0, TIFR0;
+#define WGM01	1
+#define OCIE0A	1
+#define OCF0A	1
+
+// EEPROM, as much as the at90usb1286 has, and the avr-libc calls used
+// on it.  Writes complete at once.
+#define E2END	4095
+
+extern uint8_t hal_host_eeprom[E2END + 1];
+
+#define eeprom_is_ready()	1
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, &hal_host_eeprom[(uintptr_t)src], n);
+}
+
+static inline uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+	return hal_host_eeprom[(uintptr_t)addr];
+}
+
+static inline void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+	hal_host_eeprom[(uintptr_t)addr] = value;
+}
+
+// avr-libc <util/crc16.h>, CRC-16 with polynomial 0xA001
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+	int i;
+
+	crc ^= a;
+	for (i = 0; i < 8; i++)
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	return crc;
+}
+
+// LED ports and timer 1; the counter reads 0, as if every compare
+// match were served at once
+extern volatile uint8_t PORTA, PORTC, PORTD, PORTF;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t OCR1A, TCNT1;
+#define WGM12	3
+#define CS10	0
+#define OCIE1A	1
+
+// timer 2, the lighting frame clock
+extern volatile uint8_t TCCR2A, TCCR2B, OCR2A, TIMSK2, TCNT2, TIFR2;
+#define WGM21	1
+#define CS20	0
+#define CS21	1
+#define CS22	2
+#define OCIE2A	1
+#define OCF2A	1
+
+// simulated time is advanced by the caller, settling and busy waits
+// are instant
+#define HAL_SETTLE_US(us)
+#define HAL_LED_DELAY_CYCLES(n)
+
+// Row inputs are computed from the simulated key matrix and whichever
+// column PORTB currently selects, like the real mux would.
+#define PINB	(hal_host_pinb())
+#define PINE	(hal_host_pine())
+uint8_t hal_host_pinb(void);
+uint8_t hal_host_pine(void);
+
+// Row edge interrupts only set a flag; the caller runs PCINT0_vect
+// when it changes a row while the flag is set
+#define HAL_ROWS_WAKE_ENABLE()	(hal_host_rows_wake = 1)
+#define HAL_ROWS_WAKE_DISABLE()	(hal_host_rows_wake = 0)
+extern volatile uint8_t hal_host_rows_wake;
+
+#define HAL_EP_SELECT(n)	(hal_host_ep = (n))
+#define HAL_EP_WRITABLE()	(hal_host_ep_writable())
+#define HAL_EP_WRITE(b)		(hal_host_ep_write(b))
+#define HAL_EP_RELEASE()	(hal_host_ep_release())
+#define HAL_EP_READABLE()	(hal_host_ep_readable())
+#define HAL_EP_READ()		(hal_host_ep_read())
+#define HAL_EP_RELEASE_OUT()	(hal_host_ep_release_out())
+#define HAL_USB_FRAME()		(hal_host_frame)
+
+extern uint8_t hal_host_ep;
+extern volatile uint8_t hal_host_frame;
+uint8_t hal_host_ep_writable(void);
+void hal_host_ep_write(uint8_t b);
+void hal_host_ep_release(void);
+uint8_t hal_host_ep_readable(void);
+uint8_t hal_host_ep_read(void);
+void hal_host_ep_release_out(void);
+
+// Simulated key matrix: bit n of hal_host_keys[col] set means the key
+// on row n of that column is held down.
+#define HAL_HOST_COLUMNS	16
+extern uint8_t hal_host_keys[HAL_HOST_COLUMNS];
+
+// Simulated IN endpoints: each has two banks like the real double
+// buffered ones, and a released bank is collected when the host sends
+// an IN token.  hal_host_in_tokens() polls every endpoint once; the
+// hook, when set, is called for each packet collected, and the last
+// packet is always kept.
+#define HAL_HOST_ENDPOINTS	7
+#define HAL_HOST_EP_SIZE	64
+void hal_host_in_tokens(void);
+uint8_t hal_host_out_packet(uint8_t n, const uint8_t *buf, uint8_t len);
+extern void (*hal_host_in_hook)(uint8_t ep, const uint8_t *buf, uint8_t len);
+extern uint8_t hal_host_in_last[HAL_HOST_EP_SIZE];
+extern uint8_t hal_host_in_last_len;
+extern uint32_t hal_host_in_count;
+
+// Interrupt vectors compiled as plain functions
+void TIMER0_COMPA_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER2_COMPA_vect(void);
+void PCINT0_vect(void);
+
+// Start of frame, in place of USB_GEN_vect, and the host's
+// HID_SET_PROTOCOL request (usb_keyboard.c)
+void usb_host_frame(void);
+void usb_host_set_protocol(uint8_t protocol);
+
+#endif
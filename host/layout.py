@@ -0,0 +1,329 @@
+#!/usr/bin/env python3
+# Compiles the board description (layout.txt) into layout.h, the sizes
+# of the key and LED matrices, and layout.c, the built in keymap, the
+# LED grid and the key positions on it, all in flash.  Checks that no
+# two keys share a matrix position or an LED, that every row of keys
+# fills the board, that every key name is defined in usb_keyboard.h or
+# keymap.h, and that the sizes fit the way the firmware packs them,
+# then prints what the tables cost at keymap.h's KEYMAP_LAYERS.
+#
+#   host/layout.py [layout.txt [layout.h layout.c]]
+
+import os
+import re
+import sys
+import textwrap
+
+# The firmware headers the key names and the keymap size come from
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+# Tags taking a number, and how many there are of each before one runs
+# into the next (keymap.h)
+KM_CALL = re.compile(r'^([A-Z]+)\((\d+)\)$')
+KM_CALL_COUNT = {'MACRO': 16, 'PLAY': 8, 'REC': 8, 'TG': 8, 'MO': 8,
+	'DF': 8}
+
+# usb_keyboard.h also defines the modifier bits as KEY_ names, which
+# are not keycodes
+KEY_MODIFIER = re.compile(r'^((LEFT|RIGHT)_)?(CTRL|SHIFT|ALT|GUI)$')
+
+# Limits of the packed formats: MATRIX_EVENT() keeps the column in 4
+# bits and the row in 3, LED_CELL() the anode in 3, led_dirty has a
+# bit per cathode and grid columns are bytes
+MAX_COLUMNS = 16
+MAX_ROWS = 8
+MAX_CATHODES = 16
+MAX_ANODES = 8
+MAX_GRID_WIDTH = 255
+
+
+class LayoutError(Exception):
+	pass
+
+
+def read_names():
+	"""The KEY_ names of usb_keyboard.h, the KM_ names and tags taking a
+	number of keymap.h, each without its prefix, and the KEYMAP_LAYERS
+	default"""
+	usb = open(os.path.join(SRC_DIR, 'usb_keyboard.h')).read()
+	km = open(os.path.join(SRC_DIR, 'keymap.h')).read()
+	keys = {m for m in re.findall(r'^#define\s+KEY_(\w+)\s', usb, re.M)
+		if not KEY_MODIFIER.match(m)}
+	names = set(re.findall(r'^#define\s+KM_(\w+)\s', km, re.M))
+	calls = set(re.findall(r'^#define\s+KM_(\w+)\(n\)', km, re.M))
+	m = re.search(r'^#define\s+KEYMAP_LAYERS\s+(\d+)', km, re.M)
+	if not m:
+		raise LayoutError('keymap.h: no KEYMAP_LAYERS')
+	return keys, names, calls, int(m.group(1))
+
+
+def keycode(name, names):
+	if name == '-':
+		return None
+	if name in names or KM_CALL.match(name):
+		return 'KM_' + name
+	return 'KEY_' + name
+
+
+def check_names(rows, keys, names, calls):
+	for row in rows:
+		for key in row:
+			for name in key['keys']:
+				if name == '-' or name in names or name in keys:
+					continue
+				m = KM_CALL.match(name)
+				if m and m.group(1) in calls:
+					if int(m.group(2)) < \
+					    KM_CALL_COUNT.get(m.group(1), 0):
+						continue
+					raise LayoutError('%s: %s goes up to %d' %
+						(key['where'], m.group(1),
+						KM_CALL_COUNT.get(m.group(1), 0) - 1))
+				hint = ''
+				if KEY_MODIFIER.match(name):
+					hint = ', modifiers are LCTRL, LSHIFT ... RGUI'
+				raise LayoutError('%s: no key %s in usb_keyboard.h '
+					'or keymap.h%s' % (key['where'], name, hint))
+
+
+def parse(path):
+	board = {}
+	rows = []
+	for n, line in enumerate(open(path), 1):
+		words = line.split('#', 1)[0].split()
+		if not words:
+			continue
+		where = '%s:%d' % (path, n)
+		try:
+			if words[0] in ('matrix', 'leds'):
+				board[words[0]] = (int(words[1]), int(words[2]))
+			elif words[0] == 'width':
+				board['width'] = int(words[1])
+			elif words[0] == 'row':
+				rows.append([])
+			elif rows:
+				col, row, cathode, anode, width = map(int, words[:5])
+				rows[-1].append({'col': col, 'row': row,
+					'cathode': cathode, 'anode': anode,
+					'width': width, 'keys': words[5:],
+					'where': where})
+			else:
+				raise ValueError
+		except (ValueError, IndexError):
+			raise LayoutError('%s: can\'t read "%s"' % (where, line.strip()))
+	for name in ('matrix', 'leds', 'width'):
+		if name not in board:
+			raise LayoutError('%s: no "%s" line' % (path, name))
+	return board, rows
+
+
+def check(board, rows):
+	columns, matrix_rows = board['matrix']
+	cathodes, anodes = board['leds']
+	grid_width = 4 * board['width']
+
+	if columns > MAX_COLUMNS or matrix_rows > MAX_ROWS:
+		raise LayoutError('matrix is at most %d by %d' %
+			(MAX_COLUMNS, MAX_ROWS))
+	if cathodes > MAX_CATHODES or anodes > MAX_ANODES:
+		raise LayoutError('at most %d cathodes and %d anodes' %
+			(MAX_CATHODES, MAX_ANODES))
+	if grid_width > MAX_GRID_WIDTH:
+		raise LayoutError('board is at most %d keys wide' %
+			(MAX_GRID_WIDTH // 4))
+	if len(rows) != matrix_rows:
+		raise LayoutError('%d rows of keys for %d matrix rows' %
+			(len(rows), matrix_rows))
+
+	switches = {}
+	leds = {}
+	for y, keys in enumerate(rows):
+		x = 0
+		for key in keys:
+			where = key['where']
+			pos = (key['col'], key['row'])
+			led = (key['cathode'], key['anode'])
+			if key['col'] >= columns or key['row'] >= matrix_rows:
+				raise LayoutError('%s: no matrix position %d %d' %
+					(where, key['col'], key['row']))
+			if key['cathode'] >= cathodes or key['anode'] >= anodes:
+				raise LayoutError('%s: no LED %d %d' % (where,
+					key['cathode'], key['anode']))
+			# led.h: LED_KEY_CELL_Y(row) is the grid row
+			if key['row'] != matrix_rows - 1 - y:
+				raise LayoutError('%s: keys in row %d of the board '
+					'must be on matrix row %d' %
+					(where, y, matrix_rows - 1 - y))
+			if key['width'] <= 0:
+				raise LayoutError('%s: width must be at least 1' %
+					where)
+			if pos in switches:
+				raise LayoutError('%s: matrix position %d %d is '
+					'taken at %s' % (where, pos[0], pos[1],
+					switches[pos]))
+			if led in leds:
+				raise LayoutError('%s: LED %d %d is taken at %s' %
+					(where, led[0], led[1], leds[led]))
+			switches[pos] = where
+			leds[led] = where
+			key['x'] = x
+			x += key['width']
+		if x != grid_width:
+			raise LayoutError('row %d of the board is %d quarter '
+				'keys wide, not %d' % (y, x, grid_width))
+
+
+def entries_line(entries, indent):
+	lines = []
+	for i in range(0, len(entries), 3):
+		part = entries[i:i + 3]
+		text = ''
+		for j, e in enumerate(part):
+			text += e + (',' if i + j < len(entries) - 1 else '')
+			if j < len(part) - 1:
+				text += '\t' * max(1, 3 - len(e + ',') // 8)
+		lines.append(indent + text)
+	return '\n'.join(lines)
+
+
+def generate(board, rows, path, names, keymap_layers):
+	columns, matrix_rows = board['matrix']
+	cathodes, anodes = board['leds']
+	grid_width = 4 * board['width']
+	layers = max([len(k['keys']) for keys in rows for k in keys] + [1])
+	nkeys = sum(len(keys) for keys in rows)
+
+	# the keymap tables are sized by the firmware's KEYMAP_LAYERS,
+	# whatever the layout uses of them
+	flash = [
+		('keymap', keymap_layers * matrix_rows * columns),
+		('led_grid', matrix_rows * grid_width),
+		('led_key_x', matrix_rows * columns),
+	]
+	ram = [
+		('keymap_cache', keymap_layers * matrix_rows * columns),
+		('key_down', matrix_rows * columns),
+		('matrix_state', columns),
+		('debounce', columns * matrix_rows + columns),
+		('led_color', cathodes * anodes * 3),
+		('led_planes', 2 * cathodes * 8 * 3),
+	]
+
+	h = []
+	h.append('#ifndef layout_h__\n#define layout_h__\n')
+	h.append('// Generated by host/layout.py from %s, do not edit.' % path)
+	h.append('//')
+	cost = '%d keys, %d keymap layers of KEYMAP_LAYERS %d.  Tables in ' \
+		'flash, %d bytes: %s.  RAM sized by the layout, %d bytes: %s.' % \
+		(nkeys, layers, keymap_layers, sum(n for _, n in flash),
+		', '.join('%s %d' % f for f in flash), sum(n for _, n in ram),
+		', '.join('%s %d' % r for r in ram))
+	h += ['// ' + l for l in textwrap.wrap(cost, 68)] + ['']
+	h.append('#define KEYBOARD_WIDTH\t%d' % board['width'])
+	h.append('#define KEYBOARD_HEIGHT\t%d' % matrix_rows)
+	h.append('#define KEY_MATRIX_IN\t%d\t// mux columns' % columns)
+	h.append('#define KEY_MATRIX_OUT\t%d\t// rows' % matrix_rows)
+	h.append('#define LED_MATRIX_OUT\t%d\t// cathodes' % cathodes)
+	h.append('#define LED_MATRIX_IN\t%d\t// anodes, 3 outputs each' % anodes)
+	h.append('#define LAYOUT_LAYERS\t%d' % layers)
+	h.append('#define LAYOUT_KEYS\t%d' % nkeys)
+	h.append('\n#endif')
+
+	c = []
+	c.append('// Generated by host/layout.py from %s, do not edit.\n' % path)
+	c.append('#include "hal.h"')
+	c.append('#include "usb_keyboard.h"')
+	c.append('#include "keymap.h"')
+	c.append('#include "led.h"\n')
+	c.append('#if KEYMAP_LAYERS < LAYOUT_LAYERS')
+	c.append('#error "the layout has more layers than KEYMAP_LAYERS"')
+	c.append('#endif\n')
+
+	c.append('// Keycodes by [layer][row][column], rows as read back on '
+		'the PINB/PINE')
+	c.append('// inputs and columns as selected on the PORTB mux.  Listed '
+		'top row')
+	c.append('// first and left to right.')
+	c.append('const uint8_t PROGMEM keymap[KEYMAP_LAYERS][KEY_MATRIX_OUT]'
+		'[KEY_MATRIX_IN] = {')
+	layer_blocks = []
+	for layer in range(layers):
+		row_blocks = []
+		for keys in rows:
+			entries = []
+			for k in keys:
+				code = keycode(k['keys'][layer], names) \
+					if layer < len(k['keys']) else None
+				if code:
+					entries.append('[%d]%s= %s' % (k['col'],
+						'  ' if k['col'] < 10 else ' ',
+						code))
+			if entries:
+				row_blocks.append('\t\t[%d] = {\n%s\n\t\t}' %
+					(keys[0]['row'],
+					entries_line(entries, '\t\t\t')))
+		layer_blocks.append('\t[%d] = {\n%s\n\t}' % (layer,
+			',\n'.join(row_blocks)))
+	c.append(',\n'.join(layer_blocks))
+	c.append('};\n')
+
+	c.append('// Which LED lights each grid cell, every key spanning the '
+		'cells under it')
+	c.append('const uint8_t PROGMEM led_grid[LED_GRID_HEIGHT]'
+		'[LED_GRID_WIDTH] = {')
+	blocks = []
+	for y, keys in enumerate(rows):
+		lines = ['\t\t[%2d ... %2d] = LED_CELL(%d, %d),' % (k['x'],
+			k['x'] + k['width'] - 1, k['cathode'], k['anode'])
+			for k in keys]
+		blocks.append('\t[%d] = {\n%s\n\t}' % (y, '\n'.join(lines)))
+	c.append(',\n'.join(blocks))
+	c.append('};\n')
+
+	c.append('// Grid column under the middle of each key, by [row]'
+		'[column] as in')
+	c.append('// keymap[]')
+	c.append('const uint8_t PROGMEM led_key_x[KEY_MATRIX_OUT]'
+		'[KEY_MATRIX_IN] = {')
+	blocks = []
+	for keys in rows:
+		entries = ['[%d]%s= %d' % (k['col'],
+			'  ' if k['col'] < 10 else ' ', k['x'] + k['width'] // 2)
+			for k in keys]
+		lines = []
+		for i in range(0, len(entries), 4):
+			part = entries[i:i + 4]
+			lines.append('\t\t' + ',\t'.join(part) +
+				(',' if i + 4 < len(entries) else ''))
+		blocks.append('\t[%d] = {\n%s\n\t}' % (keys[0]['row'],
+			'\n'.join(lines)))
+	c.append(',\n'.join(blocks))
+	c.append('};')
+
+	return '\n'.join(h) + '\n', '\n'.join(c) + '\n', flash, ram, nkeys
+
+
+def main(argv):
+	src = argv[1] if len(argv) > 1 else 'layout.txt'
+	out_h = argv[2] if len(argv) > 2 else 'layout.h'
+	out_c = argv[3] if len(argv) > 3 else 'layout.c'
+	try:
+		keys, names, calls, keymap_layers = read_names()
+		board, rows = parse(src)
+		check(board, rows)
+		check_names(rows, keys, names, calls)
+	except (OSError, LayoutError) as e:
+		sys.stderr.write('%s\n' % e)
+		return 1
+	h, c, flash, ram, nkeys = generate(board, rows, src, names,
+		keymap_layers)
+	open(out_h, 'w').write(h)
+	open(out_c, 'w').write(c)
+	print('%s: %d keys, flash %d bytes (%s), RAM %d bytes' % (src, nkeys,
+		sum(n for _, n in flash), ', '.join('%s %d' % f for f in flash),
+		sum(n for _, n in ram)))
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))
@@ -0,0 +1,168 @@
+// The if/else chain that mapped grid cells to LEDs before led_grid[]
+// (led.c), red only, kept for the frame build comparison in bench.c.
+
+#include "hal.h"
+#include "led.h"
+
+uint8_t led_port[LED_MATRIX_OUT][3];
+
+uint8_t led_map_red(uint8_t x, uint8_t y)
+{
+	switch(y) {
+		case 0:
+			if (x < 4)
+				led_port[0][RED] |= 1 << 0;
+			else if (x < 8)
+				led_port[1][RED] |= 1 << 0;
+			else if (x < 12)
+				led_port[0][RED] |= 1 << 1;
+			else if (x < 16)
+				led_port[1][RED] |= 1 << 1;
+			else if (x < 20)
+				led_port[0][RED] |= 1 << 2;
+			else if (x < 24)
+				led_port[1][RED] |= 1 << 2;
+			else if (x < 28)
+				led_port[0][RED] |= 1 << 3;
+			else if (x < 32)
+				led_port[1][RED] |= 1 << 3;
+			else if (x < 36)
+				led_port[0][RED] |= 1 << 4;
+			else if (x < 40)
+				led_port[1][RED] |= 1 << 4;
+			else if (x < 44)
+				led_port[0][RED] |= 1 << 5;
+			else if (x < 48)
+				led_port[1][RED] |= 1 << 5;
+			else if (x < 52)
+				led_port[0][RED] |= 1 << 6;
+			else if (x < 60)
+				led_port[1][RED] |= 1 << 6;
+			else if (x < 64)
+				led_port[0][RED] |= 1 << 7;
+			else if (x < 68)
+				led_port[1][RED] |= 1 << 7;
+			return 0;
+		case 1:
+			if (x < 6)
+				led_port[2][RED] |= 1 << 0;
+			else if (x < 10)
+				led_port[3][RED] |= 1 << 0;
+			else if (x < 14)
+				led_port[2][RED] |= 1 << 1;
+			else if (x < 18)
+				led_port[3][RED] |= 1 << 1;
+			else if (x < 22)
+				led_port[2][RED] |= 1 << 2;
+			else if (x < 26)
+				led_port[3][RED] |= 1 << 2;
+			else if (x < 30)
+				led_port[2][RED] |= 1 << 3;
+			else if (x < 34)
+				led_port[3][RED] |= 1 << 3;
+			else if (x < 38)
+				led_port[2][RED] |= 1 << 4;
+			else if (x < 42)
+				led_port[3][RED] |= 1 << 4;
+			else if (x < 46)
+				led_port[2][RED] |= 1 << 5;
+			else if (x < 50)
+				led_port[3][RED] |= 1 << 5;
+			else if (x < 54)
+				led_port[2][RED] |= 1 << 6;
+			else if (x < 60)
+				led_port[3][RED] |= 1 << 6;
+			else if (x < 64)
+				led_port[2][RED] |= 1 << 7;
+			else if (x < 68)
+				led_port[3][RED] |= 1 << 7;
+			return 0;
+		case 2:
+			if (x < 7)
+				led_port[4][RED] |= 1 << 0;
+			else if (x < 11)
+				led_port[5][RED] |= 1 << 0;
+			else if (x < 15)
+				led_port[4][RED] |= 1 << 1;
+			else if (x < 19)
+				led_port[5][RED] |= 1 << 1;
+			else if (x < 23)
+				led_port[4][RED] |= 1 << 2;
+			else if (x < 27)
+				led_port[5][RED] |= 1 << 2;
+			else if (x < 31)
+				led_port[4][RED] |= 1 << 3;
+			else if (x < 35)
+				led_port[5][RED] |= 1 << 3;
+			else if (x < 39)
+				led_port[4][RED] |= 1 << 4;
+			else if (x < 43)
+				led_port[5][RED] |= 1 << 4;
+			else if (x < 47)
+				led_port[4][RED] |= 1 << 5;
+			else if (x < 51)
+				led_port[5][RED] |= 1 << 5;
+			else if (x < 60)
+				led_port[4][RED] |= 1 << 6;
+			else if (x < 64)
+				led_port[4][RED] |= 1 << 7;
+			else if (x < 68)
+				led_port[5][RED] |= 1 << 7;
+			return 0;
+		case 3:
+			if (x < 9)
+				led_port[6][RED] |= 1 << 0;
+			else if (x < 13)
+				led_port[6][RED] |= 1 << 1;
+			else if (x < 17)
+				led_port[7][RED] |= 1 << 1;
+			else if (x < 21)
+				led_port[6][RED] |= 1 << 2;
+			else if (x < 25)
+				led_port[7][RED] |= 1 << 2;
+			else if (x < 29)
+				led_port[6][RED] |= 1 << 3;
+			else if (x < 33)
+				led_port[7][RED] |= 1 << 3;
+			else if (x < 37)
+				led_port[6][RED] |= 1 << 4;
+			else if (x < 41)
+				led_port[7][RED] |= 1 << 4;
+			else if (x < 45)
+				led_port[6][RED] |= 1 << 5;
+			else if (x < 49)
+				led_port[7][RED] |= 1 << 5;
+			else if (x < 60)
+				led_port[6][RED] |= 1 << 6;
+			else if (x < 64)
+				led_port[6][RED] |= 1 << 7;
+			else if (x < 68)
+				led_port[7][RED] |= 1 << 7;
+			return 0;
+		case 4:
+			if (x < 5)
+				led_port[8][RED] |= 1 << 0;
+			else if (x < 10)
+				led_port[7][RED] |= 1 << 0;
+			else if (x < 15)
+				led_port[8][RED] |= 1 << 1;
+			else if (x < 41)
+				led_port[8][RED] |= 1 << 3;
+			else if (x < 46)
+				led_port[8][RED] |= 1 << 4;
+			else if (x < 51)
+				led_port[8][RED] |= 1 << 5;
+			else if (x < 56)
+				led_port[8][RED] |= 1 << 6;
+			else if (x < 60)
+				led_port[5][RED] |= 1 << 6;
+			else if (x < 64)
+				led_port[7][RED] |= 1 << 6;
+			else if (x < 68)
+				led_port[8][RED] |= 1 << 7;
+			return 0;
+		default:
+			return 1;
+	}
+	return 1;
+}
@@ -0,0 +1,97 @@
+// Interrupt cost instrumentation, see isr_stats.h
+
+#include "isr_stats.h"
+
+#ifdef ISR_STATS
+#include <string.h>
+
+// laid out as the feature report (the AVR build packs structs), with
+// one more entry, not reported, for calibrating
+static struct {
+	uint8_t version;
+	uint8_t count;
+	uint16_t bias;
+	uint16_t cost;
+	struct isr_stat isr[ISR_STATS_COUNT + 1];
+} report;
+
+#define CALIBRATE	ISR_STATS_COUNT
+
+typedef char isr_stats_layout[sizeof(report) - sizeof(struct isr_stat) ==
+	ISR_STATS_REPORT_SIZE ? 1 : -1];
+
+void isr_stats_clear(void)
+{
+	uint8_t intr_state = SREG, i;
+
+	cli();
+	memset(report.isr, 0, sizeof(report.isr));
+	for (i = 0; i <= ISR_STATS_COUNT; i++)
+		report.isr[i].min = 0xFFFF;
+	SREG = intr_state;
+}
+
+// Called last in an interrupt, with its start time
+void isr_stats_add(uint8_t id, uint16_t start, uint16_t late)
+{
+	uint16_t t = isr_stats_time() - start - report.bias;
+	struct isr_stat *s = &report.isr[id];
+	uint8_t bucket = 0;
+
+	s->runs++;
+	if (t < s->min)
+		s->min = t;
+	if (t > s->max)
+		s->max = t;
+	if (late > s->late_max)
+		s->late_max = late;
+	if (late > ISR_STATS_LATE)
+		s->late++;
+	while (t > 1) {
+		t >>= 1;
+		bucket++;
+	}
+	if (s->hist[bucket] != 0xFFFF)
+		s->hist[bucket]++;
+}
+
+// Start timer 3 and measure the instrumentation: an empty
+// ENTER/EXIT pair gives the cost of the two reads, and timing an
+// EXIT from outside it what the bookkeeping adds
+void isr_stats_init(void)
+{
+	uint16_t t, cost = 0xFFFF;
+	uint8_t intr_state = SREG, i;
+
+	TCCR3A = 0;
+	TCCR3B = (1<<CS30);
+	report.version = ISR_STATS_VERSION;
+	report.count = ISR_STATS_COUNT;
+	report.bias = 0;
+	isr_stats_clear();
+
+	cli();
+	for (i = 0; i < 8; i++) {
+		ISR_STATS_ENTER(0);
+		ISR_STATS_EXIT(CALIBRATE);
+	}
+	report.bias = report.isr[CALIBRATE].min;
+	for (i = 0; i < 8; i++) {
+		ISR_STATS_ENTER(0);
+		t = isr_stats_time();
+		ISR_STATS_EXIT(CALIBRATE);
+		t = isr_stats_time() - t;
+		if (t < cost)
+			cost = t;
+	}
+	report.cost = cost;
+	SREG = intr_state;
+	isr_stats_clear();
+}
+
+// One byte of the feature report, read with interrupts off
+uint8_t isr_stats_read(uint8_t offset)
+{
+	return ((const uint8_t *)&report)[offset];
+}
+#endif
@@ -0,0 +1,108 @@
+#ifndef isr_stats_h__
+#define isr_stats_h__
+
+#include <stdint.h>
+#include "hal.h"
+
+// Interrupt cost instrumentation, built in with ISR_STATS defined
+// ("make ISR_STATS=1").  Timer 3 runs free at clk/1 and each
+// instrumented interrupt reads it on entry and exit, so a sample is
+// the cycles spent in the body, less the cost of the two reads.  The
+// compiler's register saves and restores around the body are not
+// counted.  Lengths over 65535 cycles (4 ms) wrap; only the lighting
+// frame comes near that, and it also counts the time of the interrupts
+// that preempt it.
+//
+// Per interrupt: number of runs, shortest, longest and a histogram by
+// power of two (bucket n counts lengths of 2^n to 2^(n+1)-1 cycles,
+// bucket 0 also holds 0).  The timer interrupts also record how late
+// they started, in cycles from their compare match, which is how long
+// other interrupts held them off: the longest, and how many times it
+// was over ISR_STATS_LATE.  The LED refresh counts at clk/1, the scan
+// in steps of its prescaler, and the lighting frame is too coarse to
+// say, so it records none.
+//
+// isr_stats_init() measures the cost of the instrumentation itself:
+// the two timer reads, taken out of every sample, and the bookkeeping
+// added to every instrumented interrupt after its exit time is taken.
+// No ISR_STATS build has been run on a board yet, so none of the
+// interrupt lengths quoted elsewhere in the source (led.h, led.c,
+// hal.h) come from it: they are estimates until it is.
+//
+// Everything is read through a feature report on the configuration
+// interface (ISR_STATS_REPORT_SIZE bytes, little endian):
+//
+//   0  ISR_STATS_VERSION
+//   1  ISR_STATS_COUNT
+//   2  cycles taken out of each sample for the timer reads (16 bits)
+//   4  cycles of bookkeeping added to each interrupt (16 bits)
+//   6  per interrupt, in the order below, ISR_STATS_ENTRY_SIZE bytes:
+//      runs (32 bits), shortest, longest, latest start, late starts
+//      (16 bits each), then ISR_STATS_BUCKETS counts (16 bits,
+//      stopping at 65535)
+//
+// Setting the feature report clears the counts.
+#define ISR_STATS_SCAN		0	// TIMER0_COMPA_vect
+#define ISR_STATS_LED		1	// TIMER1_COMPA_vect
+#define ISR_STATS_LIGHTING	2	// TIMER2_COMPA_vect
+#define ISR_STATS_USB_GEN	3	// USB_GEN_vect
+#define ISR_STATS_USB_COM	4	// USB_COM_vect
+#define ISR_STATS_COUNT		5
+
+#define ISR_STATS_VERSION	1
+#define ISR_STATS_BUCKETS	16
+#ifndef ISR_STATS_LATE
+#define ISR_STATS_LATE		64
+#endif
+
+#define ISR_STATS_ENTRY_SIZE	(12 + 2 * ISR_STATS_BUCKETS)
+#define ISR_STATS_REPORT_SIZE	(6 + ISR_STATS_COUNT * ISR_STATS_ENTRY_SIZE)
+
+#ifdef ISR_STATS
+#ifdef HOST_BUILD
+#error "ISR_STATS needs the AVR timer 3"
+#endif
+
+struct isr_stat {
+	uint32_t runs;
+	uint16_t min;
+	uint16_t max;
+	uint16_t late_max;
+	uint16_t late;
+	uint16_t hist[ISR_STATS_BUCKETS];
+};
+
+void isr_stats_init(void);
+void isr_stats_add(uint8_t id, uint16_t start, uint16_t late);
+void isr_stats_clear(void);
+uint8_t isr_stats_read(uint8_t offset);
+
+// Timer 3, read with interrupts off.  Reading the low byte latches
+// the high byte for the read after it, and the lighting interrupt runs
+// with interrupts on: one nested between the two reads would latch its
+// own high byte in place of this one's.
+static inline uint16_t isr_stats_time(void)
+{
+	uint8_t intr_state = SREG;
+	uint16_t t;
+
+	cli();
+	t = TCNT3;
+	SREG = intr_state;
+	return t;
+}
+
+// First and last thing in an interrupt: late is the delay to the
+// interrupt's start, read on entry, or 0
+#define ISR_STATS_ENTER(late)					\
+	uint16_t isr_stats_start = isr_stats_time();		\
+	uint16_t isr_stats_late = (late)
+#define ISR_STATS_EXIT(id)					\
+	isr_stats_add((id), isr_stats_start, isr_stats_late)
+#else
+#define isr_stats_init()
+#define ISR_STATS_ENTER(late)
+#define ISR_STATS_EXIT(id)
+#endif
+
+#endif
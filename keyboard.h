@@ -0,0 +1,10 @@
+#ifndef keyboard_h__
+#define keyboard_h__
+
+// Physical layout of the board, shared by the scan, keymap and
+// lighting code.  The sizes and the tables that go with them (the
+// built in keymap, led_grid[] and led_key_x[]) are all generated from
+// layout.txt: edit that and run "make layout".
+#include "layout.h"
+
+#endif
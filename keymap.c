@@ -0,0 +1,154 @@
+/* Keyboard example for Teensy USB Development Board
+ * http://www.pjrc.com/teensy/usb_keyboard.html
+ * Copyright (c) 2008 PJRC.COM, LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "usb_keyboard.h"
+#include "keymap.h"
+#include "matrix.h"
+#include "config.h"
+#include "macro.h"
+
+uint8_t keymap_layers = 0;
+uint8_t keymap_default_layer = 0;
+
+uint8_t keymap_cache[KEYMAP_LAYERS][KEY_MATRIX_OUT][KEY_MATRIX_IN];
+
+// Entry each key resolved to when it was pressed, by [row][column], so
+// a layer change while it is down does not change what it releases
+static uint8_t key_down[KEY_MATRIX_OUT][KEY_MATRIX_IN];
+
+// Start from the built in keymap, config_init() then loads any saved one
+void keymap_init(void)
+{
+	memcpy_P(keymap_cache, keymap, sizeof(keymap_cache));
+}
+
+// Change one key, saved with the rest of the configuration
+void keymap_set(uint8_t layer, uint8_t km_in, uint8_t km_out, uint8_t key)
+{
+	if (layer >= KEYMAP_LAYERS || km_in >= KEY_MATRIX_IN ||
+	    km_out >= KEY_MATRIX_OUT)
+		return;
+	keymap_cache[layer][km_out][km_in] = key;
+	config_changed();
+}
+
+// Set or clear a keycode in the report bitmap, returns non-zero if
+// that changed it
+static uint8_t key_set(uint8_t key, uint8_t down)
+{
+	uint8_t *p = &keyboard_nkro_keys[key >> 3];
+	uint8_t bit = 1 << (key & 7);
+
+	if (key >= KEYBOARD_NKRO_KEYS || ((*p & bit) != 0) == down)
+		return 0;
+	*p ^= bit;
+	return 1;
+}
+
+// Non-zero if a key still down resolved to entry key, so that releasing
+// another one with the same entry, the left of two shift keys say,
+// leaves it down
+static uint8_t key_held(uint8_t key)
+{
+	const uint8_t *p = &key_down[0][0];
+	uint8_t n = sizeof(key_down);
+
+	do {
+		if (*p++ == key)
+			return 1;
+	} while (--n);
+	return 0;
+}
+
+// The entry for a key: from the highest layer turned on that does not
+// leave it transparent, or else from the default layer
+static uint8_t keymap_resolve(uint8_t col, uint8_t row)
+{
+	uint8_t layer, key;
+
+	for (layer = KEYMAP_LAYERS; layer--; ) {
+		if (keymap_layers & (1 << layer)) {
+			key = key_map(layer, col, row);
+			if (key != KM_TRNS)
+				return key;
+		}
+	}
+	return key_map(keymap_default_layer, col, row);
+}
+
+// Apply a key press or release from the scan to keyboard_nkro_keys[],
+// keyboard_modifier_keys and the layer state.  A key is looked up in
+// the layers when it is pressed, and releases whatever that gave,
+// unless another key down gave the same.  Returns non-zero if the
+// report changed.
+uint8_t keymap_event(uint8_t event)
+{
+	uint8_t col, row, key, mods, pressed;
+
+	col = MATRIX_EVENT_COL(event);
+	row = MATRIX_EVENT_ROW(event);
+	pressed = MATRIX_EVENT_PRESSED(event) ? 1 : 0;
+	if (pressed) {
+		key = keymap_resolve(col, row);
+		key_down[row][col] = key;
+	} else {
+		key = key_down[row][col];
+		key_down[row][col] = KM_TRNS;
+		if (key_held(key))
+			return 0;
+	}
+
+	if (KM_IS_TAG(key)) {
+		if (KM_IS_MOD(key)) {
+			mods = keyboard_modifier_keys;
+			if (pressed)
+				keyboard_modifier_keys |= KM_MOD_BIT(key);
+			else
+				keyboard_modifier_keys &= ~KM_MOD_BIT(key);
+			macro_record(key, pressed);
+			return keyboard_modifier_keys != mods;
+		}
+		if (KM_IS_MACRO(key)) {
+			macro_key(key, pressed);
+			return 0;
+		}
+		if (KM_LAYER(key) >= KEYMAP_LAYERS)
+			return 0;
+		if (key >= KM_DF(0)) {
+			if (pressed)
+				keymap_default_layer = KM_LAYER(key);
+		} else if (key >= KM_MO(0)) {
+			if (pressed)
+				keymap_layers |= 1 << KM_LAYER(key);
+			else
+				keymap_layers &= ~(1 << KM_LAYER(key));
+		} else if (pressed) {
+			keymap_layers ^= 1 << KM_LAYER(key);
+		}
+		return 0;
+	}
+	if (key == KM_TRNS || key == KM_NO)
+		return 0;
+	macro_record(key, pressed);
+	return key_set(key, pressed);
+}
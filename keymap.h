@@ -0,0 +1,82 @@
+#ifndef keymap_h__
+#define keymap_h__
+
+#include <stdint.h>
+#include "hal.h"
+#include "keyboard.h"
+
+// The keymap is a stack of layers.  Layer entries are HID keycodes,
+// except for the tagged values below which the scan turns into
+// modifier bits, layer changes or macros instead of a key in the
+// report.  Keycodes from 0xC0 up are past the report bitmap anyway.
+// Modifiers use their HID usages (0xE0-0xE7), so the modifier bit is
+// just the low three bits of the entry.
+#define KM_LCTRL	0xE0
+#define KM_LSHIFT	0xE1
+#define KM_LALT		0xE2
+#define KM_LGUI		0xE3
+#define KM_RCTRL	0xE4
+#define KM_RSHIFT	0xE5
+#define KM_RALT		0xE6
+#define KM_RGUI		0xE7
+
+// Layer keys, for layers 0 to 7:
+//   KM_TG(n)  toggle layer n on or off
+//   KM_MO(n)  layer n on while the key is held
+//   KM_DF(n)  make layer n the default, the one under all the others
+#define KM_TG(n)	(0xE8 + (n))
+#define KM_MO(n)	(0xF0 + (n))
+#define KM_DF(n)	(0xF8 + (n))
+#define KM_FN		KM_MO(1)
+
+// Macro keys, see macro.h:
+//   KM_MACRO(n)  play built in macro n (0 to 15)
+//   KM_PLAY(n)   play recorded macro n (0 to 7)
+//   KM_REC(n)    start recording macro n, or stop recording
+#define KM_MACRO(n)	(0xC0 + (n))
+#define KM_PLAY(n)	(0xD0 + (n))
+#define KM_REC(n)	(0xD8 + (n))
+
+// KM_TRNS, the value of entries left out, falls through to the next
+// active layer down.  KM_NO is no key, hiding the layers below.
+#define KM_TRNS		0x00
+#define KM_NO		0x01
+
+#define KM_IS_TAG(k)	((k) >= KM_MACRO(0))
+#define KM_IS_MACRO(k)	((k) >= KM_MACRO(0) && (k) < KM_LCTRL)
+#define KM_IS_MOD(k)	(((k) & 0xF8) == KM_LCTRL)
+#define KM_MOD_BIT(k)	(1 << ((k) & 0x07))
+#define KM_LAYER(k)	((k) & 0x07)
+
+#ifndef KEYMAP_LAYERS
+#define KEYMAP_LAYERS	2
+#endif
+
+#if KEYMAP_LAYERS > 8
+#error "at most 8 keymap layers"
+#endif
+
+// The keymap built in, and the one in use: a copy in RAM, loaded from
+// the saved configuration at boot (see config.h), so looking keys up
+// never reads flash or EEPROM
+extern const uint8_t PROGMEM keymap[KEYMAP_LAYERS][KEY_MATRIX_OUT][KEY_MATRIX_IN];
+extern uint8_t keymap_cache[KEYMAP_LAYERS][KEY_MATRIX_OUT][KEY_MATRIX_IN];
+
+// Layers on through KM_TG and KM_MO keys, one bit each, and the default
+extern uint8_t keymap_layers;
+extern uint8_t keymap_default_layer;
+
+// keymap entry on layer for the key on column km_in, row km_out: one
+// load and the index arithmetic, whatever the layout.  The cost on the
+// target is estimated from the source and not measured; the native
+// bench ("make bench") only shows it did not grow.
+static inline uint8_t key_map(uint8_t layer, uint8_t km_in, uint8_t km_out)
+{
+	return keymap_cache[layer][km_out][km_in];
+}
+
+void keymap_init(void);
+void keymap_set(uint8_t layer, uint8_t km_in, uint8_t km_out, uint8_t key);
+uint8_t keymap_event(uint8_t event);
+
+#endif
@@ -0,0 +1,191 @@
+// Generated by host/layout.py from layout.txt, do not edit.
+
+#include "hal.h"
+#include "usb_keyboard.h"
+#include "keymap.h"
+#include "led.h"
+
+#if KEYMAP_LAYERS < LAYOUT_LAYERS
+#error "the layout has more layers than KEYMAP_LAYERS"
+#endif
+
+// Keycodes by [layer][row][column], rows as read back on the PINB/PINE
+// inputs and columns as selected on the PORTB mux.  Listed top row
+// first and left to right.
+const uint8_t PROGMEM keymap[KEYMAP_LAYERS][KEY_MATRIX_OUT][KEY_MATRIX_IN] = {
+	[0] = {
+		[4] = {
+			[15] = KEY_ESC,		[14] = KEY_1,		[13] = KEY_2,
+			[12] = KEY_3,		[11] = KEY_4,		[10] = KEY_5,
+			[9]  = KEY_6,		[8]  = KEY_7,		[7]  = KEY_8,
+			[6]  = KEY_9,		[5]  = KEY_0,		[4]  = KEY_MINUS,
+			[3]  = KEY_EQUAL,	[2]  = KEY_BACKSPACE,	[1]  = KEY_DELETE,
+			[0]  = KEY_NUM_LOCK
+		},
+		[3] = {
+			[15] = KEY_TAB,		[14] = KEY_Q,		[13] = KEY_W,
+			[12] = KEY_E,		[11] = KEY_R,		[10] = KEY_T,
+			[9]  = KEY_Y,		[8]  = KEY_U,		[7]  = KEY_I,
+			[6]  = KEY_O,		[5]  = KEY_P,		[4]  = KEY_LEFT_BRACE,
+			[3]  = KEY_RIGHT_BRACE,	[2]  = KEY_BACKSLASH,	[1]  = KEY_PAGE_UP,
+			[0]  = KEY_HOME
+		},
+		[2] = {
+			[15] = KEY_CAPS_LOCK,	[14] = KEY_A,		[13] = KEY_S,
+			[12] = KEY_D,		[11] = KEY_F,		[10] = KEY_G,
+			[9]  = KEY_H,		[8]  = KEY_J,		[7]  = KEY_K,
+			[5]  = KEY_L,		[4]  = KEY_SEMICOLON,	[3]  = KEY_QUOTE,
+			[2]  = KEY_ENTER,	[1]  = KEY_PAGE_DOWN,	[0]  = KEY_END
+		},
+		[1] = {
+			[15] = KM_LSHIFT,	[13] = KEY_Z,		[12] = KEY_X,
+			[11] = KEY_C,		[10] = KEY_V,		[9]  = KEY_B,
+			[8]  = KEY_N,		[7]  = KEY_M,		[6]  = KEY_COMMA,
+			[5]  = KEY_PERIOD,	[4]  = KEY_SLASH,	[2]  = KM_RSHIFT,
+			[1]  = KEY_UP,		[0]  = KEY_PRINTSCREEN
+		},
+		[0] = {
+			[15] = KM_LCTRL,	[14] = KM_LGUI,		[13] = KM_LALT,
+			[9]  = KEY_SPACE,	[5]  = KM_RALT,		[4]  = KM_FN,
+			[3]  = KM_RCTRL,	[2]  = KEY_LEFT,	[1]  = KEY_DOWN,
+			[0]  = KEY_RIGHT
+		}
+	},
+	[1] = {
+		[4] = {
+			[15] = KEY_TILDE,	[14] = KEY_F1,		[13] = KEY_F2,
+			[12] = KEY_F3,		[11] = KEY_F4,		[10] = KEY_F5,
+			[9]  = KEY_F6,		[8]  = KEY_F7,		[7]  = KEY_F8,
+			[6]  = KEY_F9,		[5]  = KEY_F10,		[4]  = KEY_F11,
+			[3]  = KEY_F12,		[1]  = KEY_INSERT,	[0]  = KEY_SCROLL_LOCK
+		},
+		[3] = {
+			[14] = KM_REC(0),	[13] = KM_REC(1)
+		},
+		[2] = {
+			[14] = KM_PLAY(0),	[13] = KM_PLAY(1)
+		},
+		[1] = {
+			[0]  = KEY_PAUSE
+		}
+	}
+};
+
+// Which LED lights each grid cell, every key spanning the cells under it
+const uint8_t PROGMEM led_grid[LED_GRID_HEIGHT][LED_GRID_WIDTH] = {
+	[0] = {
+		[ 0 ...  3] = LED_CELL(0, 0),
+		[ 4 ...  7] = LED_CELL(1, 0),
+		[ 8 ... 11] = LED_CELL(0, 1),
+		[12 ... 15] = LED_CELL(1, 1),
+		[16 ... 19] = LED_CELL(0, 2),
+		[20 ... 23] = LED_CELL(1, 2),
+		[24 ... 27] = LED_CELL(0, 3),
+		[28 ... 31] = LED_CELL(1, 3),
+		[32 ... 35] = LED_CELL(0, 4),
+		[36 ... 39] = LED_CELL(1, 4),
+		[40 ... 43] = LED_CELL(0, 5),
+		[44 ... 47] = LED_CELL(1, 5),
+		[48 ... 51] = LED_CELL(0, 6),
+		[52 ... 59] = LED_CELL(1, 6),
+		[60 ... 63] = LED_CELL(0, 7),
+		[64 ... 67] = LED_CELL(1, 7),
+	},
+	[1] = {
+		[ 0 ...  5] = LED_CELL(2, 0),
+		[ 6 ...  9] = LED_CELL(3, 0),
+		[10 ... 13] = LED_CELL(2, 1),
+		[14 ... 17] = LED_CELL(3, 1),
+		[18 ... 21] = LED_CELL(2, 2),
+		[22 ... 25] = LED_CELL(3, 2),
+		[26 ... 29] = LED_CELL(2, 3),
+		[30 ... 33] = LED_CELL(3, 3),
+		[34 ... 37] = LED_CELL(2, 4),
+		[38 ... 41] = LED_CELL(3, 4),
+		[42 ... 45] = LED_CELL(2, 5),
+		[46 ... 49] = LED_CELL(3, 5),
+		[50 ... 53] = LED_CELL(2, 6),
+		[54 ... 59] = LED_CELL(3, 6),
+		[60 ... 63] = LED_CELL(2, 7),
+		[64 ... 67] = LED_CELL(3, 7),
+	},
+	[2] = {
+		[ 0 ...  6] = LED_CELL(4, 0),
+		[ 7 ... 10] = LED_CELL(5, 0),
+		[11 ... 14] = LED_CELL(4, 1),
+		[15 ... 18] = LED_CELL(5, 1),
+		[19 ... 22] = LED_CELL(4, 2),
+		[23 ... 26] = LED_CELL(5, 2),
+		[27 ... 30] = LED_CELL(4, 3),
+		[31 ... 34] = LED_CELL(5, 3),
+		[35 ... 38] = LED_CELL(4, 4),
+		[39 ... 42] = LED_CELL(5, 4),
+		[43 ... 46] = LED_CELL(4, 5),
+		[47 ... 50] = LED_CELL(5, 5),
+		[51 ... 59] = LED_CELL(4, 6),
+		[60 ... 63] = LED_CELL(4, 7),
+		[64 ... 67] = LED_CELL(5, 7),
+	},
+	[3] = {
+		[ 0 ...  8] = LED_CELL(6, 0),
+		[ 9 ... 12] = LED_CELL(6, 1),
+		[13 ... 16] = LED_CELL(7, 1),
+		[17 ... 20] = LED_CELL(6, 2),
+		[21 ... 24] = LED_CELL(7, 2),
+		[25 ... 28] = LED_CELL(6, 3),
+		[29 ... 32] = LED_CELL(7, 3),
+		[33 ... 36] = LED_CELL(6, 4),
+		[37 ... 40] = LED_CELL(7, 4),
+		[41 ... 44] = LED_CELL(6, 5),
+		[45 ... 48] = LED_CELL(7, 5),
+		[49 ... 59] = LED_CELL(6, 6),
+		[60 ... 63] = LED_CELL(6, 7),
+		[64 ... 67] = LED_CELL(7, 7),
+	},
+	[4] = {
+		[ 0 ...  4] = LED_CELL(8, 0),
+		[ 5 ...  9] = LED_CELL(7, 0),
+		[10 ... 14] = LED_CELL(8, 1),
+		[15 ... 40] = LED_CELL(8, 3),
+		[41 ... 45] = LED_CELL(8, 4),
+		[46 ... 50] = LED_CELL(8, 5),
+		[51 ... 55] = LED_CELL(8, 6),
+		[56 ... 59] = LED_CELL(5, 6),
+		[60 ... 63] = LED_CELL(7, 6),
+		[64 ... 67] = LED_CELL(8, 7),
+	}
+};
+
+// Grid column under the middle of each key, by [row][column] as in
+// keymap[]
+const uint8_t PROGMEM led_key_x[KEY_MATRIX_OUT][KEY_MATRIX_IN] = {
+	[4] = {
+		[15] = 2,	[14] = 6,	[13] = 10,	[12] = 14,
+		[11] = 18,	[10] = 22,	[9]  = 26,	[8]  = 30,
+		[7]  = 34,	[6]  = 38,	[5]  = 42,	[4]  = 46,
+		[3]  = 50,	[2]  = 56,	[1]  = 62,	[0]  = 66
+	},
+	[3] = {
+		[15] = 3,	[14] = 8,	[13] = 12,	[12] = 16,
+		[11] = 20,	[10] = 24,	[9]  = 28,	[8]  = 32,
+		[7]  = 36,	[6]  = 40,	[5]  = 44,	[4]  = 48,
+		[3]  = 52,	[2]  = 57,	[1]  = 62,	[0]  = 66
+	},
+	[2] = {
+		[15] = 3,	[14] = 9,	[13] = 13,	[12] = 17,
+		[11] = 21,	[10] = 25,	[9]  = 29,	[8]  = 33,
+		[7]  = 37,	[5]  = 41,	[4]  = 45,	[3]  = 49,
+		[2]  = 55,	[1]  = 62,	[0]  = 66
+	},
+	[1] = {
+		[15] = 4,	[13] = 11,	[12] = 15,	[11] = 19,
+		[10] = 23,	[9]  = 27,	[8]  = 31,	[7]  = 35,
+		[6]  = 39,	[5]  = 43,	[4]  = 47,	[2]  = 54,
+		[1]  = 62,	[0]  = 66
+	},
+	[0] = {
+		[15] = 2,	[14] = 7,	[13] = 12,	[9]  = 28,
+		[5]  = 43,	[4]  = 48,	[3]  = 53,	[2]  = 58,
+		[1]  = 62,	[0]  = 66
+	}
+};
@@ -0,0 +1,20 @@
+#ifndef layout_h__
+#define layout_h__
+
+// Generated by host/layout.py from layout.txt, do not edit.
+//
+// 71 keys, 2 keymap layers of KEYMAP_LAYERS 2.  Tables in flash, 580
+// bytes: keymap 160, led_grid 340, led_key_x 80.  RAM sized by the
+// layout, 1000 bytes: keymap_cache 160, key_down 80, matrix_state 16,
+// debounce 96, led_color 216, led_planes 432.
+
+#define KEYBOARD_WIDTH	17
+#define KEYBOARD_HEIGHT	5
+#define KEY_MATRIX_IN	16	// mux columns
+#define KEY_MATRIX_OUT	5	// rows
+#define LED_MATRIX_OUT	9	// cathodes
+#define LED_MATRIX_IN	8	// anodes, 3 outputs each
+#define LAYOUT_LAYERS	2
+#define LAYOUT_KEYS	71
+
+#endif
@@ -0,0 +1,213 @@
+// Binary code modulation driver for the multiplexed RGB LED matrix
+
+#include <string.h>
+#include "hal.h"
+#include "led.h"
+#include "color.h"
+#include "isr_stats.h"
+
+// Colors as set by led_set(), 8 bits per channel
+static uint8_t led_color[LED_MATRIX_OUT][LED_MATRIX_IN][3];
+
+// Cathodes changed since the last led_update(), and those changed in
+// the frame last handed to the refresh, which the other buffer lacks,
+// one bit each
+static uint16_t led_dirty, led_queued;
+
+// The same colors as port bytes: for each cathode and bit-plane, the
+// red, green and blue anode bits to drive during that plane.  There
+// are two frames of them.  The refresh interrupt reads only the front
+// one and led_update() writes only the back one; setting led_swap
+// hands the back one over, and the interrupt swaps the two when it
+// next starts again from cathode 0, so every refresh shows one whole
+// frame.  A frame handed over but not yet taken can be taken back by
+// clearing led_swap.  led_hurry() sets it to 2, and the frame is then
+// taken at the next cathode instead: every cathode still shows one
+// whole frame, but that refresh shows two.
+typedef uint8_t led_frame_t[LED_MATRIX_OUT][LED_BCM_PLANES][3];
+
+static led_frame_t led_planes[2];
+static led_frame_t *led_front = &led_planes[0];
+static led_frame_t *led_back = &led_planes[1];
+static volatile uint8_t led_swap;
+
+// Where the refresh is: the cathode lit and the plane it is in
+static volatile uint8_t led_cathode, led_plane;
+
+uint16_t led_show_wait;
+
+// Start refreshing on timer 1, in CTC mode with no prescaler
+void led_init(void)
+{
+	HAL_LED_ANODES(0, 0, 0);
+	HAL_LED_CATHODE(0);
+	// planes 0 and 1 of cathode 0, dark, as the interrupt would start
+	// them
+	led_plane = 1;
+	TCCR1A = 0;
+	TCCR1B = (1<<WGM12) | (1<<CS10);
+	OCR1A = 3 * LED_BCM_UNIT - 1;
+	TIMSK1 = (1<<OCIE1A);
+}
+
+void led_set(uint8_t cathode, uint8_t anode, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t *c = led_color[cathode][anode];
+
+	c[RED] = r;
+	c[GREEN] = g;
+	c[BLUE] = b;
+	led_dirty |= 1 << cathode;
+}
+
+void led_set_cell(uint8_t x, uint8_t y, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t cell = led_cell(x, y);
+
+	led_set(LED_CELL_CATHODE(cell), LED_CELL_ANODE(cell), r, g, b);
+}
+
+void led_fill(uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t i, j;
+
+	for (i = 0; i < LED_MATRIX_OUT; i++)
+		for (j = 0; j < LED_MATRIX_IN; j++)
+			led_set(i, j, r, g, b);
+}
+
+// Turn the colors into bit-planes in the back buffer, only for the
+// cathodes it is missing, and queue it for display.  The gamma curve is
+// applied here, so colors stay linear everywhere else.  A frame still
+// waiting for the refresh to take it is taken back and updated, so
+// the refresh always gets the latest one.
+void led_update(void)
+{
+	uint8_t cathode, plane, color, anode, bit, v;
+	uint8_t intr_state, withdrawn;
+	uint16_t todo;
+	uint8_t (*planes)[3];
+
+	// once led_swap is clear the refresh leaves the back buffer alone
+	intr_state = SREG;
+	cli();
+	withdrawn = led_swap;
+	led_swap = 0;
+	SREG = intr_state;
+
+	if (withdrawn) {
+		// the back buffer already has the frame it was queued with
+		todo = led_dirty;
+		led_queued |= led_dirty;
+	} else {
+		// it is the old front buffer, so it also lacks the last frame
+		todo = led_dirty | led_queued;
+		led_queued = led_dirty;
+	}
+	for (cathode = 0; cathode < LED_MATRIX_OUT; cathode++) {
+		if (!(todo & (1 << cathode)))
+			continue;
+		planes = (*led_back)[cathode];
+		memset(planes, 0, sizeof((*led_back)[cathode]));
+		bit = 1;
+		for (anode = 0; anode < LED_MATRIX_IN; anode++) {
+			for (color = 0; color < 3; color++) {
+				v = color_gamma(led_color[cathode][anode][color]);
+				for (plane = 0; v; plane++, v >>= 1) {
+					if (v & 1)
+						planes[plane][color] |= bit;
+				}
+			}
+			bit <<= 1;
+		}
+	}
+	led_dirty = 0;
+	// the frame must be complete in memory before it is handed over
+	__asm__ __volatile__ ("" ::: "memory");
+	led_swap = 1;
+	// what is left of this refresh, the current plane counted whole
+	led_show_wait = (LED_MATRIX_OUT - led_cathode) * 255 -
+		(1 << led_plane) + 1;
+}
+
+// Have the refresh take the frame queued by led_update() at the next
+// cathode rather than at the end of the refresh, for a frame that
+// should go up as soon as it can
+void led_hurry(void)
+{
+	uint8_t intr_state;
+
+	intr_state = SREG;
+	cli();
+	if (led_swap) {
+		led_swap = 2;
+		// what is left of this cathode
+		led_show_wait = 256 - (1 << led_plane);
+	}
+	SREG = intr_state;
+}
+
+// Timer 1 compare match, at the end of every bit-plane.  Moves on to
+// the next plane, or to the next cathode, sets how long it lasts and
+// drives its anodes.  Between the last cathode and the first it takes
+// a new frame, if one is waiting, or between any two if the frame was
+// hurried.
+//
+// Plane 0, LED_BCM_UNIT cycles, is shorter than this interrupt, so it
+// gets no interrupt of its own: a new cathode's plane 0 is lit here,
+// for a busy wait of LED_BCM_UNIT cycles, then plane 1 is, and the
+// compare value set for the end of plane 1.  The shortest plane left
+// to an interrupt is plane 2, 4 units, 256 cycles at the default unit.
+// The interrupt is estimated at about 100 cycles besides the wait, not
+// measured on the target.
+//
+// The counter restarts at the match, but another interrupt running
+// then delays this one, and the compare value is not buffered in CTC
+// mode: a late write below the count would only match after the
+// counter wraps at 0xFFFF, leaving a plane lit for 4 ms.  A plane the
+// counter has already run past is skipped instead, its time given to
+// the next one, which costs that plane's bit on one cathode for one
+// refresh.
+ISR(TIMER1_COMPA_vect)
+{
+	uint8_t cathode = led_cathode, plane = led_plane;
+	uint16_t top, count;
+	const uint8_t *p;
+	led_frame_t *frame;
+	ISR_STATS_ENTER(TCNT1);
+
+	while (1) {
+		if (++plane >= LED_BCM_PLANES) {
+			if (++cathode >= LED_MATRIX_OUT)
+				cathode = 0;
+			if (led_swap && (cathode == 0 || led_swap == 2)) {
+				frame = led_front;
+				led_front = led_back;
+				led_back = frame;
+				led_swap = 0;
+			}
+			// blank before switching cathodes to avoid ghosting
+			HAL_LED_ANODES(0, 0, 0);
+			HAL_LED_CATHODE(cathode);
+			// planes 0 and 1 from now, however late this is
+			p = (*led_front)[cathode][0];
+			OCR1A = TCNT1 + 3 * LED_BCM_UNIT - 1;
+			HAL_LED_ANODES(p[RED], p[GREEN], p[BLUE]);
+			HAL_LED_DELAY_CYCLES(LED_BCM_UNIT);
+			plane = 1;
+			break;
+		}
+		top = (LED_BCM_UNIT << plane) - 1;
+		OCR1A = top;
+		// past the compare value means the match was missed
+		count = TCNT1;
+		if (count <= top)
+			break;
+		TCNT1 = count - top - 1;
+	}
+	led_cathode = cathode;
+	led_plane = plane;
+	p = (*led_front)[cathode][plane];
+	HAL_LED_ANODES(p[RED], p[GREEN], p[BLUE]);
+	ISR_STATS_EXIT(ISR_STATS_LED);
+}
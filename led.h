@@ -0,0 +1,80 @@
+#ifndef led_h__
+#define led_h__
+
+#include <stdint.h>
+#include "hal.h"
+#include "keyboard.h"
+
+#define RED	0
+#define GREEN	1
+#define BLUE	2
+
+// The LEDs are multiplexed: PORTA selects one of the LED_MATRIX_OUT
+// cathodes and PORTC, PORTD and PORTF drive the red, green and blue
+// anodes of the LED_MATRIX_IN LEDs on it.  Intensity comes from binary
+// code modulation: each cathode is lit for 8 bit-planes in turn, plane
+// n lasting LED_BCM_UNIT << n CPU cycles, and an LED's anode is on for
+// the planes matching the set bits of its 8 bit value.  Timer 1
+// interrupts once per plane and only copies three precomputed port
+// bytes, so the cost per interrupt is small and fixed.
+//
+// Refresh rate = F_CPU / (LED_BCM_UNIT * 255 * LED_MATRIX_OUT), about
+// 109 Hz at the default unit.  Plane 0 is lit by the interrupt that
+// starts a cathode, which waits it out, and plane 1 follows in the
+// same interrupt, so timer 1 only interrupts after planes 1 to 7.  The
+// shortest of those, plane 2, must stay above the length of the
+// refresh interrupt (estimated at about 100 cycles, unmeasured), and
+// the unit costs every cathode a busy wait of that many cycles.  A
+// plane can still be over before a refresh interrupt held up by the
+// scan or USB interrupts runs; it is then skipped (see
+// TIMER1_COMPA_vect), which costs a dim LED one step of brightness for
+// that refresh.
+#ifndef LED_BCM_UNIT
+#define LED_BCM_UNIT	64
+#endif
+#define LED_BCM_PLANES	8
+
+// The LEDs seen as a grid of quarter key cells, LED_GRID_WIDTH across
+// each of the key rows, from the top.  Every cell maps to the LED under
+// it, packed as a cathode and an anode bit.  A lookup is one
+// pgm_read_byte for all three colors, estimated at about 8 cycles
+// against up to about 40 for the led_map_red() chain it replaced
+// (host/led_chain.c); both figures are counted from the source, not
+// measured on the target.
+#define LED_GRID_WIDTH		(4 * KEYBOARD_WIDTH)
+#define LED_GRID_HEIGHT		KEYBOARD_HEIGHT
+#define LED_CELL(cathode, anode)	(((cathode) << 3) | (anode))
+#define LED_CELL_CATHODE(cell)		((cell) >> 3)
+#define LED_CELL_ANODE(cell)		((cell) & 7)
+
+extern const uint8_t PROGMEM led_grid[LED_GRID_HEIGHT][LED_GRID_WIDTH];
+
+static inline uint8_t led_cell(uint8_t x, uint8_t y)
+{
+	return pgm_read_byte(&led_grid[y][x]);
+}
+
+// Where each key of the matrix sits on the grid: the key on matrix
+// row r is on grid row LED_GRID_HEIGHT - 1 - r
+extern const uint8_t PROGMEM led_key_x[KEY_MATRIX_OUT][KEY_MATRIX_IN];
+
+static inline uint8_t led_key_cell_x(uint8_t col, uint8_t row)
+{
+	return pgm_read_byte(&led_key_x[row][col]);
+}
+
+#define LED_KEY_CELL_Y(row)	(LED_GRID_HEIGHT - 1 - (row))
+
+// Upper bound on the time until the frame queued by the last
+// led_update() goes up, in units of LED_BCM_UNIT cycles: up to a whole
+// refresh, or a cathode (255 units) after led_hurry()
+extern uint16_t led_show_wait;
+
+void led_init(void);
+void led_set(uint8_t cathode, uint8_t anode, uint8_t r, uint8_t g, uint8_t b);
+void led_set_cell(uint8_t x, uint8_t y, uint8_t r, uint8_t g, uint8_t b);
+void led_fill(uint8_t r, uint8_t g, uint8_t b);
+void led_update(void);
+void led_hurry(void);
+
+#endif
@@ -0,0 +1,436 @@
+// Lighting effects engine, run from timer 2
+
+#include <string.h>
+#include "hal.h"
+#include "led.h"
+#include "lighting.h"
+#include "color.h"
+#include "matrix.h"
+#include "event_queue.h"
+#include "isr_stats.h"
+#include "config.h"
+
+// timer 2 counts at F_CPU / 1024
+#define LIGHTING_TIMER_US	(1024000000UL / F_CPU)
+#define LIGHTING_BUDGET		(LIGHTING_BUDGET_US / LIGHTING_TIMER_US)
+
+struct effect {
+	void (*init)(void);
+	void (*step)(void);
+};
+
+volatile struct lighting_stats lighting_stats;
+
+// Mode and color asked for by the main program, picked up by the next
+// frame so effects only ever run in the frame interrupt
+static volatile uint8_t mode_next = DEFAULT_LMODE;
+static volatile uint8_t mode_reset = 1;
+static uint8_t mode = DEFAULT_LMODE;
+static uint8_t color[3];
+
+// The mode and color as saved, applied by lighting_init()
+struct lighting_config lighting_config = {
+	.mode = DEFAULT_LMODE,
+	.color = {0x80, 0x80, 0x80},
+};
+
+// Timer 2 periods started, dropped frames included.  With TCNT2 this
+// makes a clock in 64 us steps, used to time key presses to light.
+static volatile uint8_t periods;
+
+// Key presses for the touch mode, from lighting_key_event() in the
+// main loop to the frame interrupt
+static struct event_queue key_events;
+
+// Timing of one press at a time: the clock when it was queued, and
+// whether it is waiting for its frame (1) or for that frame to be
+// queued for display (2)
+static volatile uint8_t touch_timing;
+static uint8_t touch_periods, touch_count;
+
+// Light or clear a whole column of grid cells
+static void column_set(uint8_t x, uint8_t on)
+{
+	uint8_t y;
+
+	for (y = 0; y < LED_GRID_HEIGHT; y++) {
+		if (on)
+			led_set_cell(x, y, color[RED], color[GREEN], color[BLUE]);
+		else
+			led_set_cell(x, y, 0, 0, 0);
+	}
+}
+
+static void solid_init(void)
+{
+	led_fill(color[RED], color[GREEN], color[BLUE]);
+}
+
+static void none_step(void)
+{
+}
+
+// A bar of light sweeping across the board, one cell per frame
+static uint8_t wave_x;
+
+static void wave_left_step(void)
+{
+	column_set(LED_GRID_WIDTH - 1 - wave_x, 0);
+	if (++wave_x >= LED_GRID_WIDTH)
+		wave_x = 0;
+	column_set(LED_GRID_WIDTH - 1 - wave_x, 1);
+}
+
+static void wave_left_init(void)
+{
+	led_fill(0, 0, 0);
+	wave_x = 0;
+	column_set(LED_GRID_WIDTH - 1, 1);
+}
+
+static void wave_right_init(void)
+{
+	led_fill(0, 0, 0);
+	wave_x = 0;
+	column_set(0, 1);
+}
+
+static void wave_right_step(void)
+{
+	column_set(wave_x, 0);
+	if (++wave_x >= LED_GRID_WIDTH)
+		wave_x = 0;
+	column_set(wave_x, 1);
+}
+
+// One lit cell winding along the rows, left to right on the even ones
+// and back on the odd ones
+static uint8_t snake_x, snake_y;
+
+static void snake_init(void)
+{
+	led_fill(0, 0, 0);
+	snake_x = snake_y = 0;
+	led_set_cell(0, 0, color[RED], color[GREEN], color[BLUE]);
+}
+
+static void snake_step(void)
+{
+	led_set_cell(snake_x, snake_y, 0, 0, 0);
+	if (snake_y & 1) {
+		if (snake_x > 0)
+			snake_x--;
+		else if (++snake_y >= LED_GRID_HEIGHT)
+			snake_y = 0;
+	} else {
+		if (snake_x < LED_GRID_WIDTH - 1)
+			snake_x++;
+		else if (++snake_y >= LED_GRID_HEIGHT)
+			snake_y = snake_x = 0;
+	}
+	led_set_cell(snake_x, snake_y, color[RED], color[GREEN], color[BLUE]);
+}
+
+// The color wheel spread across the board, turning one step per frame.
+// Every LED changes each frame, so this is the most expensive effect.
+static uint8_t rainbow_hue;
+static uint8_t rainbow_offset[LED_MATRIX_OUT][LED_MATRIX_IN];
+
+static void rainbow_step(void)
+{
+	uint8_t cathode, anode, v;
+	uint8_t rgb[3];
+
+	// as bright as the brightest channel of the set color
+	v = color[RED];
+	if (color[GREEN] > v)
+		v = color[GREEN];
+	if (color[BLUE] > v)
+		v = color[BLUE];
+	rainbow_hue++;
+	for (cathode = 0; cathode < LED_MATRIX_OUT; cathode++) {
+		for (anode = 0; anode < LED_MATRIX_IN; anode++) {
+			color_hsv(rainbow_hue + rainbow_offset[cathode][anode],
+				255, v, rgb);
+			led_set(cathode, anode, rgb[RED], rgb[GREEN], rgb[BLUE]);
+		}
+	}
+}
+
+// Hue offset of each LED from the leftmost cell it lights
+static void rainbow_init(void)
+{
+	uint8_t x, y, cell;
+
+	for (x = LED_GRID_WIDTH; x--; ) {
+		for (y = 0; y < LED_GRID_HEIGHT; y++) {
+			cell = led_cell(x, y);
+			rainbow_offset[LED_CELL_CATHODE(cell)][LED_CELL_ANODE(cell)] =
+				(x * 15) >> 2;
+		}
+	}
+	rainbow_step();
+}
+
+// Keys light up as they are pressed and fade, and each press sends a
+// ripple out across the board.  There are at most TOUCH_RIPPLES
+// ripples, a new press taking over the oldest when they are all in use,
+// so a frame costs the same however many keys go down.
+#define TOUCH_RIPPLES	8
+#define TOUCH_LIFE	16	// frames a ripple lasts, moving 1 key per 2
+#define TOUCH_FADE	16	// brightness lost per frame
+
+static struct ripple {
+	uint8_t x, y, age;
+} ripples[TOUCH_RIPPLES];
+
+// brightness of each LED, 0 to 255, and frames until they are all dark
+static uint8_t touch_level[LED_MATRIX_OUT][LED_MATRIX_IN];
+static uint8_t touch_active;
+
+static void touch_light(uint8_t x, uint8_t y, uint8_t level)
+{
+	uint8_t cell = led_cell(x, y);
+	uint8_t *l = &touch_level[LED_CELL_CATHODE(cell)][LED_CELL_ANODE(cell)];
+
+	if (level > *l)
+		*l = level;
+}
+
+static void touch_init(void)
+{
+	uint8_t i, event;
+
+	led_fill(0, 0, 0);
+	for (i = 0; i < TOUCH_RIPPLES; i++)
+		ripples[i].age = TOUCH_LIFE;
+	memset(touch_level, 0, sizeof(touch_level));
+	touch_active = 0;
+	while (event_queue_pop(&key_events, &event)) ;
+	touch_timing = 0;
+}
+
+static void touch_press(uint8_t event)
+{
+	uint8_t i, oldest = 0;
+	struct ripple *r;
+
+	for (i = 1; i < TOUCH_RIPPLES; i++) {
+		if (ripples[i].age > ripples[oldest].age)
+			oldest = i;
+	}
+	r = &ripples[oldest];
+	r->x = led_key_cell_x(MATRIX_EVENT_COL(event), MATRIX_EVENT_ROW(event));
+	r->y = LED_KEY_CELL_Y(MATRIX_EVENT_ROW(event));
+	r->age = 0;
+	touch_light(r->x, r->y, 255);
+}
+
+static void touch_step(void)
+{
+	uint8_t i, cathode, anode, event, radius, level, dy, dx, y;
+	struct ripple *r;
+
+	while (event_queue_pop(&key_events, &event)) {
+		touch_press(event);
+		touch_active = 255 / TOUCH_FADE + 1;
+		if (touch_timing == 1)
+			touch_timing = 2;
+	}
+	if (!touch_active)
+		return;
+	touch_active--;
+
+	for (cathode = 0; cathode < LED_MATRIX_OUT; cathode++)
+		for (anode = 0; anode < LED_MATRIX_IN; anode++)
+			touch_level[cathode][anode] =
+				color_sub(touch_level[cathode][anode], TOUCH_FADE);
+
+	// each ripple is a diamond, radius keys from its key along the
+	// rows and a key width per row across them
+	for (i = 0; i < TOUCH_RIPPLES; i++) {
+		r = &ripples[i];
+		if (r->age >= TOUCH_LIFE)
+			continue;
+		if (++r->age >= TOUCH_LIFE)
+			continue;
+		touch_active = 255 / TOUCH_FADE + 1;
+		radius = r->age >> 1;
+		level = 255 - r->age * (256 / TOUCH_LIFE);
+		for (y = 0; y < LED_GRID_HEIGHT; y++) {
+			dy = y > r->y ? y - r->y : r->y - y;
+			if (dy > radius)
+				continue;
+			dx = (radius - dy) * 4;
+			if (r->x >= dx)
+				touch_light(r->x - dx, y, level);
+			if (r->x + dx < LED_GRID_WIDTH)
+				touch_light(r->x + dx, y, level);
+		}
+	}
+
+	for (cathode = 0; cathode < LED_MATRIX_OUT; cathode++) {
+		for (anode = 0; anode < LED_MATRIX_IN; anode++) {
+			level = touch_level[cathode][anode];
+			led_set(cathode, anode, color_scale(color[RED], level),
+				color_scale(color[GREEN], level),
+				color_scale(color[BLUE], level));
+		}
+	}
+}
+
+// Indexed by mode
+static const struct effect PROGMEM effects[NUM_LMODES] = {
+	[DEFAULT_LMODE]		= {solid_init, none_step},
+	[TOUCH_LMODE]		= {touch_init, touch_step},
+	[LEFT_WAVE_LMODE]	= {wave_left_init, wave_left_step},
+	[RIGHT_WAVE_LMODE]	= {wave_right_init, wave_right_step},
+	[SNAKE_LMODE]		= {snake_init, snake_step},
+	[RAINBOW_LMODE]		= {rainbow_init, rainbow_step},
+};
+
+// Take up lighting_config after it was changed in place, restarting
+// the effect
+void lighting_apply(void)
+{
+	uint8_t intr_state = SREG;
+
+	cli();
+	if (lighting_config.mode < NUM_LMODES)
+		mode_next = lighting_config.mode;
+	color[RED] = lighting_config.color[RED];
+	color[GREEN] = lighting_config.color[GREEN];
+	color[BLUE] = lighting_config.color[BLUE];
+	mode_reset = 1;
+	SREG = intr_state;
+}
+
+// Start the frame timer: CTC mode, clk/1024
+void lighting_init(void)
+{
+	lighting_apply();
+
+	TCCR2A = (1<<WGM21);
+	TCCR2B = (1<<CS22) | (1<<CS21) | (1<<CS20);
+	OCR2A = F_CPU / 1024 / LIGHTING_FPS - 1;
+	TIMSK2 = (1<<OCIE2A);
+}
+
+void lighting_set_mode(uint8_t m)
+{
+	if (m >= NUM_LMODES)
+		return;
+	mode_next = m;
+	mode_reset = 1;
+	lighting_config.mode = m;
+	config_changed();
+}
+
+uint8_t lighting_mode(void)
+{
+	return mode_next;
+}
+
+// Key events from the scan, passed on to the touch mode.  A press
+// starts its frame at once instead of waiting out the frame period.
+void lighting_key_event(uint8_t event)
+{
+	uint8_t intr_state;
+
+	if (mode_next != TOUCH_LMODE || !MATRIX_EVENT_PRESSED(event))
+		return;
+	if (!event_queue_push(&key_events, event))
+		return;
+
+	intr_state = SREG;
+	cli();
+	// the next count matches, unless the frame is already due
+	if (!(TIFR2 & (1<<OCF2A)) && TCNT2 < OCR2A - 1)
+		TCNT2 = OCR2A - 1;
+	if (!touch_timing) {
+		touch_periods = periods;
+		touch_count = TCNT2;
+		if (TIFR2 & (1<<OCF2A)) {
+			touch_periods++;
+			touch_count = TCNT2;
+		}
+		touch_timing = 1;
+	}
+	SREG = intr_state;
+}
+
+// Restarts the effect, which redraws it in the new color
+void lighting_set_color(uint8_t r, uint8_t g, uint8_t b)
+{
+	lighting_config.color[RED] = r;
+	lighting_config.color[GREEN] = g;
+	lighting_config.color[BLUE] = b;
+	lighting_apply();
+	config_changed();
+}
+
+// One frame of the current effect
+static inline void lighting_frame(void)
+{
+	static volatile uint8_t busy;
+	const struct effect *e;
+	void (*fn)(void);
+	uint8_t t;
+	uint16_t ticks;
+
+	periods++;
+	if (busy) {
+		// the previous frame is still running, drop this one
+		lighting_stats.overruns++;
+		return;
+	}
+	busy = 1;
+
+	if (mode_reset) {
+		mode_reset = 0;
+		mode = mode_next;
+		e = &effects[mode];
+		fn = pgm_read_ptr(&e->init);
+	} else {
+		e = &effects[mode];
+		fn = pgm_read_ptr(&e->step);
+	}
+	fn();
+	led_update();
+	if (touch_timing == 2) {
+		// a press is in this frame: it goes up at the next cathode,
+		// and the time from the press to then is measured, the wait
+		// for the refresh being the worst case
+		led_hurry();
+		ticks = (uint8_t)(periods - touch_periods) * (OCR2A + 1) +
+			TCNT2 - touch_count;
+		ticks = ticks * LIGHTING_TIMER_US +
+			(uint32_t)led_show_wait * LED_BCM_UNIT / (F_CPU / 1000000);
+		lighting_stats.latency = ticks;
+		if (ticks > lighting_stats.latency_max)
+			lighting_stats.latency_max = ticks;
+		touch_timing = 0;
+	}
+
+	// The counter restarted at the compare match that started this
+	// frame, so it holds the frame length unless the frame ran past
+	// the next match, which was then counted above
+	t = TCNT2;
+	lighting_stats.last = t;
+	if (t > lighting_stats.max)
+		lighting_stats.max = t;
+	if (t > LIGHTING_BUDGET)
+		lighting_stats.overruns++;
+	lighting_stats.frames++;
+	busy = 0;
+}
+
+// Timer 2 compare match, once per frame.  Interrupts are enabled again
+// on entry, so the scan and LED refresh interrupts run on time however
+// long the frame takes.
+ISR(TIMER2_COMPA_vect, ISR_NOBLOCK)
+{
+	ISR_STATS_ENTER(0);
+	lighting_frame();
+	ISR_STATS_EXIT(ISR_STATS_LIGHTING);
+}
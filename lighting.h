@@ -0,0 +1,75 @@
+#ifndef lighting_h__
+#define lighting_h__
+
+#include <stdint.h>
+#include "hal.h"
+
+// Lighting effects.  Each effect is an init function, which draws its
+// first frame, and a step function, which moves its previous frame on
+// by one, touching only the LEDs that change.  Timer 2 runs the
+// current effect LIGHTING_FPS times a second (62 to 1000), in an
+// interrupt that the key scan and the LED refresh can interrupt, so
+// lighting never delays them.
+//
+// A frame, the step plus encoding the changed LEDs, should finish
+// within LIGHTING_BUDGET_US.  The budget is advisory: nothing cuts a
+// frame short, since a step left half done would leave the effect
+// torn.  Frames over it, or a frame still running when the next one is
+// due (which is then dropped), count as overruns, and an effect is
+// expected to keep its step well under the budget.  Frame times are
+// measured with timer 2, in units of 64 us.
+//
+// In TOUCH_LMODE the matrix scan's key presses light the board, and
+// the time from a press reaching lighting_key_event() to its frame
+// going up on the LEDs is measured as well.  A press starts its frame
+// at the next timer 2 count, and the refresh takes that frame at the
+// next cathode (led_hurry()), so the time is at most 64 us, the frame
+// itself and one cathode of the refresh (about 1 ms): 3.1 ms with a
+// frame at the full budget, well within a frame period or a refresh.
+#ifndef LIGHTING_FPS
+#define LIGHTING_FPS		100
+#endif
+#ifndef LIGHTING_BUDGET_US
+#define LIGHTING_BUDGET_US	2000
+#endif
+
+#if LIGHTING_FPS < 62 || LIGHTING_FPS > 1000
+#error "LIGHTING_FPS must be between 62 and 1000"
+#endif
+
+#define DEFAULT_LMODE		0
+#define TOUCH_LMODE		1
+#define LEFT_WAVE_LMODE 	2
+#define RIGHT_WAVE_LMODE	3
+#define SNAKE_LMODE 		4
+#define RAINBOW_LMODE		5
+#define NUM_LMODES		6
+
+// Effect time accounting, updated by the frame interrupt
+struct lighting_stats {
+	uint32_t frames;	// frames run
+	uint16_t overruns;	// frames over budget or skipped
+	uint8_t last;		// length of the last frame, 64 us units
+	uint8_t max;		// longest frame so far, 64 us units
+	uint16_t latency;	// last key press to light, in us
+	uint16_t latency_max;	// longest of those so far
+};
+
+extern volatile struct lighting_stats lighting_stats;
+
+// Settings kept in the saved configuration
+struct lighting_config {
+	uint8_t mode;
+	uint8_t color[3];
+};
+
+extern struct lighting_config lighting_config;
+
+void lighting_init(void);
+void lighting_apply(void);
+void lighting_set_mode(uint8_t mode);
+void lighting_set_color(uint8_t r, uint8_t g, uint8_t b);
+void lighting_key_event(uint8_t event);
+uint8_t lighting_mode(void);
+
+#endif
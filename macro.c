@@ -0,0 +1,254 @@
+// Macros, see macro.h
+
+#include <string.h>
+#include "usb_keyboard.h"
+#include "keymap.h"
+#include "macro.h"
+#include "config.h"
+
+// Built in macros, for KM_MACRO(n)
+static const uint8_t PROGMEM macro_task_manager[] = {
+	MACRO_PRESS, KM_LCTRL, MACRO_PRESS, KM_LSHIFT, KEY_ESC, MACRO_END
+};
+
+static const uint8_t PROGMEM macro_lock_screen[] = {
+	MACRO_PRESS, KM_LGUI, KEY_L, MACRO_END
+};
+
+static const uint8_t * const PROGMEM macros[MACRO_ROM_COUNT] = {
+	macro_task_manager,
+	macro_lock_screen,
+};
+
+uint8_t macro_user[MACRO_USER_SIZE];
+
+// the macro playing: the next op, from flash or from macro_user
+static const uint8_t *pos = NULL;
+static uint8_t from_rom;
+static uint8_t pending = 0;		// report not yet taken by the endpoint
+static uint8_t tap_key = 0;		// tapped key, released next
+static uint8_t wait_ms = 0;
+static uint16_t wait_start;
+
+// what the macro holds down, let go at its end
+static uint8_t held_keys[KEYBOARD_NKRO_SIZE];
+static uint8_t held_mods;
+
+// the macro being recorded, spliced into macro_user when it stops
+#define NOT_RECORDING	0xFF
+static uint8_t rec_slot = NOT_RECORDING;
+static uint8_t rec_buf[MACRO_USER_SIZE];
+static uint8_t rec_len, rec_limit;
+
+// All recorded macros empty; config_init() then loads any saved ones
+void macro_init(void)
+{
+	memset(macro_user, MACRO_END, sizeof(macro_user));
+}
+
+// Index just past the MACRO_END of the recorded macro starting at i
+static uint8_t user_skip(uint8_t i)
+{
+	uint8_t op;
+
+	while (i < MACRO_USER_SIZE) {
+		op = macro_user[i++];
+		if (op == MACRO_END)
+			break;
+		if (op == MACRO_PRESS || op == MACRO_RELEASE || op == MACRO_DELAY)
+			i++;
+	}
+	return i < MACRO_USER_SIZE ? i : MACRO_USER_SIZE;
+}
+
+static uint8_t user_find(uint8_t n)
+{
+	uint8_t i = 0;
+
+	while (n--)
+		i = user_skip(i);
+	return i;
+}
+
+static void key_press(uint8_t key, uint8_t down)
+{
+	uint8_t *keys, *held, bit;
+
+	if (KM_IS_MOD(key)) {
+		keys = &keyboard_modifier_keys;
+		held = &held_mods;
+		bit = KM_MOD_BIT(key);
+	} else if (key < KEYBOARD_NKRO_KEYS) {
+		keys = &keyboard_nkro_keys[key >> 3];
+		held = &held_keys[key >> 3];
+		bit = 1 << (key & 7);
+	} else {
+		return;
+	}
+	if (down) {
+		*keys |= bit;
+		*held |= bit;
+	} else {
+		*keys &= ~bit;
+		*held &= ~bit;
+	}
+}
+
+static void release_all(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < KEYBOARD_NKRO_SIZE; i++) {
+		keyboard_nkro_keys[i] &= ~held_keys[i];
+		held_keys[i] = 0;
+	}
+	keyboard_modifier_keys &= ~held_mods;
+	held_mods = 0;
+}
+
+static void record_start(uint8_t n)
+{
+	uint8_t start = user_find(n);
+	uint8_t others = user_find(MACRO_USER_COUNT) - (user_skip(start) - start);
+
+	// room left by the others, less the new MACRO_END
+	if (others >= MACRO_USER_SIZE)
+		return;
+	rec_limit = MACRO_USER_SIZE - others - 1;
+	rec_len = 0;
+	rec_slot = n;
+}
+
+static void record_stop(void)
+{
+	uint8_t start = user_find(rec_slot);
+	uint8_t end = user_skip(start);
+	uint8_t used = user_find(MACRO_USER_COUNT);
+
+	memmove(macro_user + start + rec_len + 1, macro_user + end, used - end);
+	memcpy(macro_user + start, rec_buf, rec_len);
+	macro_user[start + rec_len] = MACRO_END;
+	used += rec_len + 1 - (end - start);
+	memset(macro_user + used, MACRO_END, MACRO_USER_SIZE - used);
+	rec_slot = NOT_RECORDING;
+	config_changed();
+}
+
+// A key the keymap resolved, while recording.  A press followed at once
+// by its release is kept as one tap byte.
+void macro_record(uint8_t key, uint8_t pressed)
+{
+	if (rec_slot == NOT_RECORDING)
+		return;
+	if (!pressed && rec_len >= 2 && rec_buf[rec_len - 2] == MACRO_PRESS &&
+	    rec_buf[rec_len - 1] == key && key > MACRO_DELAY) {
+		rec_buf[rec_len - 2] = key;
+		rec_len--;
+		return;
+	}
+	if (rec_len + 2 > rec_limit)
+		return;
+	rec_buf[rec_len++] = pressed ? MACRO_PRESS : MACRO_RELEASE;
+	rec_buf[rec_len++] = key;
+}
+
+uint8_t macro_recording(void)
+{
+	return rec_slot != NOT_RECORDING;
+}
+
+uint8_t macro_playing(void)
+{
+	return pos != NULL || pending;
+}
+
+// KM_MACRO, KM_PLAY and KM_REC keys, from keymap_event()
+void macro_key(uint8_t key, uint8_t pressed)
+{
+	const uint8_t *p;
+	uint8_t n;
+
+	if (!pressed)
+		return;
+	if (key >= KM_REC(0)) {
+		n = key - KM_REC(0);
+		if (rec_slot != NOT_RECORDING)
+			record_stop();
+		else if (n < MACRO_USER_COUNT && !macro_playing())
+			record_start(n);
+		return;
+	}
+	if (macro_playing())
+		return;
+	if (key >= KM_PLAY(0)) {
+		n = key - KM_PLAY(0);
+		if (n >= MACRO_USER_COUNT || rec_slot == n)
+			return;
+		pos = macro_user + user_find(n);
+		from_rom = 0;
+	} else {
+		n = key - KM_MACRO(0);
+		if (n >= MACRO_ROM_COUNT || !(p = pgm_read_ptr(&macros[n])))
+			return;
+		pos = p;
+		from_rom = 1;
+	}
+}
+
+static uint8_t next_byte(void)
+{
+	if (from_rom)
+		return pgm_read_byte(pos++);
+	// an edited macro_user may have lost its MACRO_END
+	if (pos >= macro_user + MACRO_USER_SIZE)
+		return MACRO_END;
+	return *pos++;
+}
+
+// From the main loop: move the playing macro on by at most one report
+void macro_task(void)
+{
+	uint8_t op;
+
+	if (pending) {
+		if (usb_keyboard_send() < 0)
+			return;
+		pending = 0;
+	}
+	if (!pos)
+		return;
+	if (wait_ms) {
+		if ((uint16_t)(usb_ms() - wait_start) < wait_ms)
+			return;
+		wait_ms = 0;
+	}
+
+	if (tap_key) {
+		key_press(tap_key, 0);
+		tap_key = 0;
+	} else {
+		switch (op = next_byte()) {
+		case MACRO_END:
+			release_all();
+			pos = NULL;
+			break;
+		case MACRO_PRESS:
+			key_press(next_byte(), 1);
+			break;
+		case MACRO_RELEASE:
+			key_press(next_byte(), 0);
+			break;
+		case MACRO_DELAY:
+			wait_ms = next_byte();
+			wait_start = usb_ms();
+			return;
+		default:
+			key_press(op, 1);
+			tap_key = op;
+			break;
+		}
+	}
+	pending = 1;
+	if (usb_keyboard_send() == 0)
+		pending = 0;
+}
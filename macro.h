@@ -0,0 +1,56 @@
+#ifndef macro_h__
+#define macro_h__
+
+#include <stdint.h>
+#include "hal.h"
+
+// Macros are byte sequences of the ops below, ended by MACRO_END.  Any
+// other byte taps that keycode, a modifier (0xE0-0xE7) included:
+// pressed in one report and released in the next.
+//
+//   MACRO_PRESS k    hold key or modifier k down
+//   MACRO_RELEASE k  let it go
+//   MACRO_DELAY n    wait n ms (1-255) before the next op
+//
+// so "Hi" is MACRO_PRESS, KM_LSHIFT, KEY_H, MACRO_RELEASE, KM_LSHIFT,
+// KEY_I, MACRO_END.  Keys the macro still holds at its end are let go.
+//
+// macro_task() plays one report at a time from the main loop, moving on
+// only once usb_keyboard_send() has taken the last one and any delay is
+// over, so however long a macro is, the scan and USB never wait on it.
+// One macro plays at a time; keys that start another meanwhile are
+// ignored.
+//
+// MACRO_ROM_COUNT macros are built in (PROGMEM, KM_MACRO(n) keys) and
+// MACRO_USER_COUNT are recorded at run time (KM_REC(n) starts and
+// stops recording, KM_PLAY(n) plays).  Recording keeps the keys in the
+// order they went down and up, not the time between them, in RAM
+// (macro_user), which is saved with the rest of the configuration.
+#define MACRO_END		0x00
+#define MACRO_PRESS		0x01
+#define MACRO_RELEASE		0x02
+#define MACRO_DELAY		0x03
+
+#define MACRO_ROM_COUNT		4
+#ifndef MACRO_USER_COUNT
+#define MACRO_USER_COUNT	4
+#endif
+#ifndef MACRO_USER_SIZE
+#define MACRO_USER_SIZE		64
+#endif
+
+#if MACRO_USER_COUNT > 8
+#error "at most 8 recorded macros"
+#endif
+
+// The recorded macros, one after the other, each ended by MACRO_END
+extern uint8_t macro_user[MACRO_USER_SIZE];
+
+void macro_init(void);
+void macro_key(uint8_t key, uint8_t pressed);
+void macro_record(uint8_t key, uint8_t pressed);
+uint8_t macro_recording(void);
+uint8_t macro_playing(void);
+void macro_task(void);
+
+#endif
@@ -0,0 +1,416 @@
+/* Keyboard example for Teensy USB Development Board
+ * http://www.pjrc.com/teensy/usb_keyboard.html
+ * Copyright (c) 2008 PJRC.COM, LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "hal.h"
+#include "usb_keyboard.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "matrix.h"
+#include "event_queue.h"
+#include "isr_stats.h"
+#include "print.h"
+#include "lighting.h"
+
+uint8_t matrix_state[KEY_MATRIX_IN];
+
+#if DEBOUNCE_MODE != DEBOUNCE_NONE
+// Per key sample counters, and per column a mask of the keys whose
+// counter is running so that quiet columns cost a single test.
+static uint8_t debounce_count[KEY_MATRIX_IN][KEY_MATRIX_OUT];
+static uint8_t debounce_busy[KEY_MATRIX_IN];
+#endif
+
+// Per row steps of the debounce, unrolled over the HAL_ROWS table so
+// every bit test and counter address is a constant
+#define DEBOUNCE_COUNT_DOWN(row, pin, bit)			\
+	if ((busy & (1<<(row))) && --count[row] == 0)		\
+		busy &= ~(1<<(row));
+#define DEBOUNCE_START(row, pin, bit)				\
+	if (diff & (1<<(row)))					\
+		count[row] = DEBOUNCE_TICKS;
+#define DEBOUNCE_SETTLE(row, pin, bit)				\
+	if (!(diff & (1<<(row))))				\
+		count[row] = 0;					\
+	else if (++count[row] >= DEBOUNCE_TICKS) {		\
+		count[row] = 0;					\
+		changes |= 1<<(row);				\
+	}
+
+// Take a raw sample of a column (bit set = key down) and return the
+// mask of keys whose debounced state changes.
+static inline uint8_t debounce(uint8_t column, uint8_t raw)
+{
+	uint8_t diff = raw ^ matrix_state[column];
+#if DEBOUNCE_MODE == DEBOUNCE_EAGER
+	uint8_t busy = debounce_busy[column];
+	uint8_t *count = debounce_count[column];
+
+	// keys still locked out after their last edge ignore the sample
+	diff &= ~busy;
+	if (busy) {
+		HAL_ROWS(DEBOUNCE_COUNT_DOWN)
+	}
+	if (diff) {
+		HAL_ROWS(DEBOUNCE_START)
+		busy |= diff;
+	}
+	debounce_busy[column] = busy;
+	return diff;
+#elif DEBOUNCE_MODE == DEBOUNCE_DEFER
+	uint8_t busy = debounce_busy[column], changes = 0;
+	uint8_t *count = debounce_count[column];
+
+	// a key that reads its settled state again restarts its count
+	if ((diff | busy) == 0)
+		return 0;
+	HAL_ROWS(DEBOUNCE_SETTLE)
+	debounce_busy[column] = diff & ~changes;
+	return changes;
+#else
+	return diff;
+#endif
+}
+
+// key events from the scan, waiting for matrix_task()
+static struct event_queue matrix_events;
+
+// passes per second, and timer 0 counts spent in the scan interrupt
+// during the last complete pass
+static uint16_t scan_rate;
+static volatile uint16_t scan_pass_busy;
+
+// idle mode, and the number of passes in a row with no key down
+static volatile uint8_t idle;
+static uint16_t quiet_passes;
+
+// ticks done of the pass under way, and the compare value of a tick
+static uint8_t scan_tick;
+static uint8_t scan_top;
+
+#ifdef SCAN_SOF_SYNC
+// timer counts to add to the next tick, which is a whole pass
+static volatile int8_t sof_correction;
+#endif
+
+// timer 0 clock select (CS02:0 = 1 to 5) and the prescaler as a shift
+static const uint8_t PROGMEM prescaler_shift[] = {0, 3, 6, 8, 10};
+
+struct matrix_config matrix_config = {
+	.scan_rate = SCAN_RATE_HZ,
+};
+
+struct matrix_stats matrix_stats;
+
+// Set timer 0 up to run the scan, at the saved rate, or SCAN_RATE_HZ
+// full passes if that is out of reach
+void matrix_init(void)
+{
+	TCCR0A = (1<<WGM01);
+	if (matrix_config.scan_rate < SCAN_RATE_MIN ||
+	    matrix_config.scan_rate > SCAN_RATE_MAX ||
+	    !matrix_set_scan_rate(matrix_config.scan_rate))
+		matrix_set_scan_rate(SCAN_RATE_HZ);
+	TIMSK0 = (1<<OCIE0A);
+}
+
+// Put matrix_config to use once the configuration protocol has written
+// it.  A rate out of range is put back, and 0 returned.
+uint8_t matrix_apply(void)
+{
+	if (matrix_config.scan_rate >= SCAN_RATE_MIN &&
+	    matrix_config.scan_rate <= SCAN_RATE_MAX &&
+	    matrix_set_scan_rate(matrix_config.scan_rate))
+		return 1;
+	matrix_config.scan_rate = scan_rate;
+	return 0;
+}
+
+void matrix_stats_update(void)
+{
+	matrix_stats.scan_rate = scan_rate;
+	matrix_stats.load = matrix_scan_load();
+	matrix_stats.idle = idle;
+}
+
+// Program timer 0 for hz full passes per second, picking the smallest
+// prescaler that fits.  Returns 0 if the rate is out of reach.
+static uint8_t scan_timer(uint16_t hz)
+{
+	uint32_t cycles;
+	uint16_t top;
+	uint8_t cs;
+
+	if (hz == 0)
+		return 0;
+	cycles = F_CPU / ((uint32_t)hz * SCAN_TICKS_PER_PASS);
+	for (cs = 0; cs < sizeof(prescaler_shift); cs++) {
+		top = cycles >> pgm_read_byte(&prescaler_shift[cs]);
+		if (top == 0)
+			return 0;
+		if (top <= 256) {
+			TCCR0B = 0;
+			scan_top = top - 1;
+			OCR0A = scan_top;
+#ifdef SCAN_SOF_SYNC
+			sof_correction = 0;
+#endif
+			TCNT0 = 0;
+			TCCR0B = cs + 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Slow the scan down and wait for a row edge, once the keyboard has
+// been left alone for MATRIX_IDLE_PASSES passes
+static void idle_enter(void)
+{
+	if (MATRIX_IDLE_RATE_HZ >= scan_rate)
+		return;
+	scan_timer(MATRIX_IDLE_RATE_HZ);
+	HAL_ROWS_WAKE_ENABLE();
+	idle = 1;
+}
+
+// Back to the full rate, with the next tick a full rate tick away.
+// Called with interrupts off.
+static void idle_leave(void)
+{
+	quiet_passes = 0;
+	if (!idle)
+		return;
+	HAL_ROWS_WAKE_DISABLE();
+	scan_timer(scan_rate);
+	idle = 0;
+}
+
+// Change the number of full matrix passes per second.  Returns 0 if
+// the rate is out of reach.
+uint8_t matrix_set_scan_rate(uint16_t hz)
+{
+	uint8_t intr_state = SREG, ok;
+
+	cli();
+	idle_leave();
+	ok = scan_timer(hz);
+	if (ok) {
+		scan_rate = hz;
+		matrix_config.scan_rate = hz;
+	}
+	SREG = intr_state;
+	return ok;
+}
+
+uint16_t matrix_scan_rate(void)
+{
+	return scan_rate;
+}
+
+uint8_t matrix_scan_load(void)
+{
+	uint16_t busy;
+	uint8_t intr_state = SREG;
+
+	cli();
+	busy = scan_pass_busy;
+	SREG = intr_state;
+	return (uint32_t)busy * 100 / ((uint32_t)(OCR0A + 1) * SCAN_TICKS_PER_PASS);
+}
+
+// Nonzero while the scan is slowed down and waiting for a key, when
+// the main loop may sleep until the next interrupt
+uint8_t matrix_idle(void)
+{
+	return idle;
+}
+
+#if (0 HAL_ROWS(HAL_ROW_COUNT)) != KEY_MATRIX_OUT
+#error "HAL_ROWS must list KEY_MATRIX_OUT rows"
+#endif
+
+#ifdef MATRIX_SCAN_SHIFT
+#define ROWS_SAMPLE()	(~HAL_ROWS_READ() & ((1 << KEY_MATRIX_OUT) - 1))
+#else
+#define ROWS_SAMPLE()	HAL_ROWS_SAMPLE()
+#endif
+
+// Queue the event for a key whose debounced state changed.  If the
+// queue is full the key keeps its old state, so the change is seen
+// again on a later pass instead of being lost.
+static inline void matrix_event(uint8_t column, uint8_t row)
+{
+	uint8_t bit = 1 << row;
+
+	if (event_queue_push(&matrix_events, MATRIX_EVENT(column, row,
+			!(matrix_state[column] & bit)))) {
+		matrix_state[column] ^= bit;
+#ifdef MATRIX_DEBUG
+		phex(MATRIX_EVENT(column, row, matrix_state[column] & bit));
+		pchar('\n');
+#endif
+	}
+}
+
+// one test per row with constant bits, from the HAL_ROWS table
+#define ROW_EVENT(row, pin, bit)		\
+	if (changes & (1<<(row)))		\
+		matrix_event(column, row);
+
+// Sample one column and queue an event for each key whose debounced
+// state changed.  Returns the raw sample.
+static inline uint8_t matrix_scan_column(uint8_t column)
+{
+	uint8_t raw, changes;
+
+	raw = ROWS_SAMPLE();
+	changes = debounce(column, raw);
+	if (changes) {
+		HAL_ROWS(ROW_EVENT)
+	}
+	return raw;
+}
+
+// Timer 0 compare match, SCAN_RATE_HZ * SCAN_TICKS_PER_PASS times per
+// second.  Reads the next SCAN_COLUMNS_PER_TICK columns of the keyboard
+// matrix and queues an event for every key that changed.  Nothing here
+// waits on USB, so the scan timing does not depend on the host.  Also
+// counts the passes with no key down, and leaves idle mode as soon as
+// one is.
+ISR(TIMER0_COMPA_vect)
+{
+	static uint8_t column = 0, down = 0;
+	static uint16_t busy = 0;
+	uint8_t n = SCAN_COLUMNS_PER_TICK;
+	ISR_STATS_ENTER((uint16_t)TCNT0 <<
+		pgm_read_byte(&prescaler_shift[(TCCR0B & 7) - 1]));
+
+
+	while (1) {
+		down |= matrix_scan_column(column);
+		column++;
+		if (column >= KEY_MATRIX_IN)
+			column = 0;
+		HAL_COLUMN_SELECT(column);
+		if (--n == 0)
+			break;
+		HAL_SETTLE_US(MATRIX_SETTLE_US);
+	}
+	if (down && idle)
+		idle_leave();
+
+	// the counter restarted at the compare match, so it now holds
+	// the time spent since then, interrupt latency included
+	busy += TCNT0;
+	if (++scan_tick >= SCAN_TICKS_PER_PASS) {
+		scan_pass_busy = busy;
+		busy = 0;
+		scan_tick = 0;
+		if (down)
+			quiet_passes = 0;
+		else if (quiet_passes < MATRIX_IDLE_PASSES &&
+				++quiet_passes == MATRIX_IDLE_PASSES)
+			idle_enter();
+		down = 0;
+	}
+#ifdef SCAN_SOF_SYNC
+	// the next pass takes the correction from the last start of
+	// frame; the counter has only just restarted, so any compare
+	// value it allows is still ahead of it
+	OCR0A = scan_top + sof_correction;
+	sof_correction = 0;
+#endif
+	ISR_STATS_EXIT(ISR_STATS_SCAN);
+}
+
+#ifdef SCAN_SOF_SYNC
+// Start of frame, from USB_GEN_vect.  At one pass per frame, measures
+// how far the last pass end was from SCAN_SOF_LEAD_US before this
+// start of frame, and has the next pass start a quarter of that
+// later or earlier, by at most a quarter pass.  A longer pass is also
+// held to a compare value of 255.
+void matrix_sof(void)
+{
+	uint8_t shift;
+	uint16_t tick_len, pos, lead;
+	int16_t err;
+
+	if (idle || scan_rate != 1000)
+		return;
+	shift = pgm_read_byte(&prescaler_shift[(TCCR0B & 7) - 1]);
+	tick_len = scan_top + 1;
+	lead = ((uint32_t)SCAN_SOF_LEAD_US * (F_CPU / 1000000)) >> shift;
+
+	// timer counts since the last pass ended, a match waiting on
+	// this interrupt included
+	pos = TCNT0;
+	if (TIFR0 & (1<<OCF0A))
+		pos += tick_len;
+	if (pos >= tick_len)
+		pos -= tick_len;
+
+	// positive: the pass ended too early, the next one starts later
+	err = pos - lead;
+	if (err > (int16_t)(tick_len / 2))
+		err -= tick_len;
+	err /= 4;
+	if (err > (int16_t)(tick_len / 4))
+		err = tick_len / 4;
+	if (err > 255 - scan_top)
+		err = 255 - scan_top;
+	if (err < -(int16_t)(tick_len / 4))
+		err = -(int16_t)(tick_len / 4);
+	sof_correction = err;
+}
+#endif
+
+// A row edge while idle: a key went down on the selected column
+ISR(PCINT0_vect)
+{
+	idle_leave();
+}
+ISR(INT6_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(INT7_vect, ISR_ALIASOF(PCINT0_vect));
+
+// Called from the main loop: apply the queued key events to the
+// report, staging it after every event that changed it.  Staging
+// merges the changes into one report where it can, and if the staging
+// slots are full the rest of the events wait in the queue until the
+// next call, so a press and its release never cancel out unsent.
+void matrix_task(void)
+{
+	static uint8_t report_changed = 0;
+	uint8_t event;
+
+	while (1) {
+		if (report_changed) {
+			if (usb_keyboard_send())
+				return;
+			report_changed = 0;
+		}
+		if (!event_queue_pop(&matrix_events, &event))
+			return;
+		report_changed = keymap_event(event);
+		lighting_key_event(event);
+	}
+}
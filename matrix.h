@@ -0,0 +1,154 @@
+#ifndef matrix_h__
+#define matrix_h__
+
+#include <stdint.h>
+#include "keyboard.h"
+#include "hal.h"
+
+// Scan scheduling.  Timer 0 runs in CTC mode and each compare match
+// samples SCAN_COLUMNS_PER_TICK columns, so a full pass of the matrix
+// takes KEY_MATRIX_IN / SCAN_COLUMNS_PER_TICK ticks.  SCAN_RATE_HZ is
+// the number of full passes per second at boot; matrix_set_scan_rate()
+// changes it at run time.  1000 matches the 1 ms bInterval of the
+// keyboard endpoint.  Sampling more than one column per tick costs a
+// MATRIX_SETTLE_US wait between columns for the rows to settle, in
+// exchange for fewer interrupts.
+//
+// The cost of the scan is measured as it runs: matrix_scan_load()
+// returns the share of the CPU spent in the scan interrupt during the
+// last pass, in percent (resolution is one timer 0 count).  No load
+// has been read off a board yet, at 1000 passes per second or any
+// other rate: the scan's cost on the target is unmeasured, and the
+// native bench's ns per tick says nothing about AVR cycles.
+//
+// The rate is also a saved setting, matrix_config, which the
+// configuration protocol can change between SCAN_RATE_MIN and
+// SCAN_RATE_MAX; it reads the rate and the load back as matrix_stats.
+#ifndef SCAN_RATE_HZ
+#define SCAN_RATE_HZ		1000
+#endif
+#define SCAN_RATE_MIN		60
+#define SCAN_RATE_MAX		1000
+#ifndef SCAN_COLUMNS_PER_TICK
+#define SCAN_COLUMNS_PER_TICK	1
+#endif
+#define SCAN_TICKS_PER_PASS	(KEY_MATRIX_IN / SCAN_COLUMNS_PER_TICK)
+#define MATRIX_SETTLE_US	1
+
+#if KEY_MATRIX_IN % SCAN_COLUMNS_PER_TICK
+#error "SCAN_COLUMNS_PER_TICK must divide KEY_MATRIX_IN"
+#endif
+
+// SCAN_SOF_SYNC locks the passes to the USB frames while the scan runs
+// at 1000 passes per second: on each start of frame, matrix_sof()
+// measures where the last pass ended and the next pass is made longer
+// or shorter, so that passes come to end SCAN_SOF_LEAD_US before the
+// start of frame.  The main loop then
+// has that long to stage the report for the host's poll at the start
+// of the frame, so a press waits for its column's sample and little
+// else.  The lead must cover the scan interrupt and the main loop;
+// the default 100 us is a guess with a wide margin, as neither has
+// been timed on the target, and the gain in press to poll time has
+// only been seen on the native bench ("-f").
+// Only the columns sampled at the end of the pass are just before the
+// poll, so it needs SCAN_COLUMNS_PER_TICK equal to KEY_MATRIX_IN, every
+// key in one tick; a scan spread over the pass gains nothing from it.
+#ifndef SCAN_SOF_LEAD_US
+#define SCAN_SOF_LEAD_US	100
+#endif
+
+#if defined(SCAN_SOF_SYNC) && SCAN_TICKS_PER_PASS != 1
+#error "SCAN_SOF_SYNC needs SCAN_COLUMNS_PER_TICK equal to KEY_MATRIX_IN"
+#endif
+
+// Debouncing, applied per key between the raw column sample and the
+// keymap.  DEBOUNCE_TICKS is the window, counted in samples of the
+// key's column (one per full matrix pass).
+//   DEBOUNCE_EAGER  report the first edge at once, then ignore the key
+//                   for DEBOUNCE_TICKS samples.  Lowest latency.
+//   DEBOUNCE_DEFER  report a change only once the key has read the new
+//                   state for DEBOUNCE_TICKS samples in a row.
+//   DEBOUNCE_NONE   pass the raw samples through.
+// A column with no key changing costs one test of its busy mask in
+// either mode; what a changing key costs on the target has not been
+// measured, only compared between the modes on the native bench
+// ("make bench" with -b for chatter).
+#define DEBOUNCE_NONE	0
+#define DEBOUNCE_EAGER	1
+#define DEBOUNCE_DEFER	2
+
+#ifndef DEBOUNCE_MODE
+#define DEBOUNCE_MODE	DEBOUNCE_EAGER
+#endif
+#ifndef DEBOUNCE_TICKS
+#define DEBOUNCE_TICKS	5
+#endif
+
+// Idle mode.  After MATRIX_IDLE_PASSES full passes with no key down,
+// the scan drops to MATRIX_IDLE_RATE_HZ passes per second, turns on
+// the row edge interrupts and lets the main loop sleep.  The rows are
+// read through the column mux, so an edge can only come from the
+// column it has selected between ticks: a press there wakes the scan
+// at once, one anywhere else when the slow scan reaches its column, at
+// most one idle pass later.  Either way the scan returns to the full
+// rate.  So the worst case from a press to the scan seeing it is one
+// idle pass, 1000 / MATRIX_IDLE_RATE_HZ ms (8 ms at the default 125),
+// plus a full rate tick; the native bench ("-q") measures 8 ms.  DEBOUNCE_EAGER reports the press from the first sample of it
+// (on the next full rate tick after an edge); DEBOUNCE_DEFER still
+// wants its DEBOUNCE_TICKS samples, the rest at the full rate.
+#ifndef MATRIX_IDLE_PASSES
+#define MATRIX_IDLE_PASSES	5000
+#endif
+#ifndef MATRIX_IDLE_RATE_HZ
+#define MATRIX_IDLE_RATE_HZ	125
+#endif
+
+// The rows of a column are sampled with one test per row, generated
+// from the HAL_ROWS table in hal.h.  MATRIX_SCAN_SHIFT builds the older
+// shift and mask read of HAL_ROWS_READ() instead, to compare the two
+// with ISR_STATS; until that is done the gain is a hand count, about
+// 15 cycles for the unrolled row steps of a changing column against 50
+// to 70 for the loops they replaced.
+//
+// MATRIX_DEBUG logs every key event from the scan interrupt on the
+// debug interface (print.h), as the event byte in hex.
+//
+// Debounced state of the key matrix, one byte per column (the PORTB
+// mux position) with bit n set while the key on row n is held down.
+extern uint8_t matrix_state[KEY_MATRIX_IN];
+
+// Key events produced by the scan when a key changes state, packed in
+// one byte: bit 7 set for a press, bits 6:3 the column, bits 2:0 the row.
+#define MATRIX_EVENT(col, row, pressed)	\
+	((uint8_t)(((pressed) ? 0x80 : 0) | ((col) << 3) | (row)))
+#define MATRIX_EVENT_PRESSED(ev)	((ev) & 0x80)
+#define MATRIX_EVENT_COL(ev)		(((ev) >> 3) & 0x0F)
+#define MATRIX_EVENT_ROW(ev)		((ev) & 0x07)
+
+// Settings kept in the saved configuration
+struct matrix_config {
+	uint16_t scan_rate;	// full passes per second
+};
+
+extern struct matrix_config matrix_config;
+
+// The scan as it runs, filled in by matrix_stats_update()
+struct matrix_stats {
+	uint16_t scan_rate;	// full passes per second
+	uint8_t load;		// matrix_scan_load(), percent
+	uint8_t idle;		// matrix_idle()
+};
+
+extern struct matrix_stats matrix_stats;
+
+void matrix_init(void);
+uint8_t matrix_apply(void);
+void matrix_stats_update(void);
+uint8_t matrix_set_scan_rate(uint16_t hz);
+uint16_t matrix_scan_rate(void);
+uint8_t matrix_scan_load(void);
+uint8_t matrix_idle(void);
+void matrix_sof(void);
+void matrix_task(void);
+
+#endif
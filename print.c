@@ -0,0 +1,32 @@
+// Debug output, see print.h
+
+#include "print.h"
+
+void print_P(const char *s)
+{
+	char c;
+
+	while (1) {
+		c = pgm_read_byte(s++);
+		if (!c) break;
+		if (c == '\n') usb_debug_putchar('\r');
+		usb_debug_putchar(c);
+	}
+}
+
+static void phex1(uint8_t c)
+{
+	usb_debug_putchar(c + ((c < 10) ? '0' : 'A' - 10));
+}
+
+void phex(uint8_t c)
+{
+	phex1(c >> 4);
+	phex1(c & 15);
+}
+
+void phex16(uint16_t i)
+{
+	phex(i >> 8);
+	phex(i);
+}
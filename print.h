@@ -0,0 +1,18 @@
+#ifndef print_h__
+#define print_h__
+
+#include <stdint.h>
+#include "hal.h"
+#include "usb_keyboard.h"
+
+// Debug output on the HID debug interface, see usb_keyboard.h.  Every
+// call only copies into the debug buffer, so these are safe from
+// interrupts.  print("some text") keeps the string in flash.
+#define print(s)	print_P(PSTR(s))
+#define pchar(c)	usb_debug_putchar(c)
+
+void print_P(const char *s);
+void phex(uint8_t c);
+void phex16(uint16_t i);
+
+#endif
@@ -0,0 +1,208 @@
+// Key press to report latency, in CPU cycles, under simavr.
+//
+// Runs the SIM_BUILD firmware (see hal.h) on a simulated SIM_MCU, an
+// atmega2560 standing in for the at90usb1286, at F_CPU and plays the
+// key matrix: whenever the firmware selects a column on PORTB 0:3, the rows of the keys held in that column are
+// pulled low on PINB 4:6 and PINE 6:7.  Every position of the matrix
+// is pressed in turn, at a pseudo random point of the scan, and the
+// time until the firmware releases a report on the keyboard endpoint
+// is recorded.  That is the time until the report is in the endpoint
+// FIFO; waiting for the host's IN token adds up to one bInterval on
+// real hardware.  Positions that send no report (empty, or layer and
+// macro keys) are counted separately.
+//
+//   latency [-v] [-n passes] [-s seed] [sim/rgb_keyboard_sim.elf]
+//
+// Not yet run: this harness and the SIM_BUILD firmware were written
+// without avr-gcc or simavr to hand and have never been compiled, so
+// no latency figures exist from it yet.  Expect the first "make sim"
+// to need fixing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_ioport.h"
+
+#ifndef SIM_MCU
+#define SIM_MCU		"atmega2560"
+#endif
+#define KEY_MATRIX_IN	16
+#define KEY_MATRIX_OUT	5
+#define KEYBOARD_EP	3
+
+// I/O addresses in data space
+#define GPIOR0		0x3E
+#define GPIOR1		0x4A
+#define GPIOR2		0x4B
+
+#define MS(n)		((avr_cycle_count_t)(n) * F_CPU / 1000)
+
+static avr_t *avr;
+static uint8_t held[KEY_MATRIX_IN];	// row bits held down, by column
+static uint8_t column;
+
+// the keyboard endpoint
+static uint8_t ep;
+static uint8_t packet[64];
+static uint8_t packet_len;
+static avr_cycle_count_t report_cycle;
+static int reports;
+
+static void rows_update(void)
+{
+	uint8_t down = held[column], r;
+
+	for (r = 0; r < 3; r++)
+		avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'),
+			4 + r), !(down & (1 << r)));
+	for (r = 3; r < 5; r++)
+		avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('E'),
+			3 + r), !(down & (1 << r)));
+}
+
+static void portb_write(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	column = value & 0x0F;
+	rows_update();
+}
+
+static void ep_select(struct avr_t *a, avr_io_addr_t addr, uint8_t v, void *p)
+{
+	ep = v;
+}
+
+static void ep_write(struct avr_t *a, avr_io_addr_t addr, uint8_t v, void *p)
+{
+	if (packet_len < sizeof(packet))
+		packet[packet_len++] = v;
+}
+
+static void ep_release(struct avr_t *a, avr_io_addr_t addr, uint8_t v, void *p)
+{
+	if (ep == KEYBOARD_EP) {
+		report_cycle = a->cycle;
+		reports++;
+	}
+	packet_len = 0;
+}
+
+// run until the given cycle, or a report, whichever is first
+static int run_until(avr_cycle_count_t end, int stop_on_report)
+{
+	int seen = reports, state;
+
+	while (avr->cycle < end) {
+		state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed) {
+			fprintf(stderr, "firmware stopped at cycle %llu\n",
+				(unsigned long long)avr->cycle);
+			exit(1);
+		}
+		if (stop_on_report && reports != seen)
+			return 1;
+	}
+	return 0;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	avr_cycle_count_t x = *(const avr_cycle_count_t *)a;
+	avr_cycle_count_t y = *(const avr_cycle_count_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "sim/rgb_keyboard_sim.elf";
+	elf_firmware_t fw;
+	avr_cycle_count_t *lat, t0;
+	int opt, verbose = 0, passes = 4, pass, col, row;
+	int n = 0, silent = 0;
+	unsigned seed = 1;
+
+	while ((opt = getopt(argc, argv, "vn:s:")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 'n': passes = atoi(optarg); break;
+		case 's': seed = strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "usage: latency [-v] [-n passes] "
+				"[-s seed] [firmware.elf]\n");
+			return 2;
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	srand(seed);
+
+	memset(&fw, 0, sizeof(fw));
+	if (elf_read_firmware(path, &fw)) {
+		fprintf(stderr, "%s: can't read firmware\n", path);
+		return 1;
+	}
+	if (!(avr = avr_make_mcu_by_name(SIM_MCU))) {
+		fprintf(stderr, "simavr has no %s\n", SIM_MCU);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &fw);
+	avr->frequency = F_CPU;
+	avr->log = LOG_WARNING;
+
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'),
+		IOPORT_IRQ_REG_PORT), portb_write, NULL);
+	avr_register_io_write(avr, GPIOR1, ep_select, NULL);
+	avr_register_io_write(avr, GPIOR2, ep_write, NULL);
+	avr_register_io_write(avr, GPIOR0, ep_release, NULL);
+	rows_update();
+
+	// boot, and let the first scans settle
+	run_until(MS(50), 0);
+
+	lat = calloc(passes * KEY_MATRIX_IN * KEY_MATRIX_OUT, sizeof(*lat));
+	for (pass = 0; pass < passes; pass++) {
+		for (col = 0; col < KEY_MATRIX_IN; col++) {
+			for (row = 0; row < KEY_MATRIX_OUT; row++) {
+				// press somewhere in the next scan pass
+				t0 = avr->cycle + rand() % MS(1);
+				run_until(t0, 0);
+				t0 = avr->cycle;
+				held[col] |= 1 << row;
+				rows_update();
+				if (run_until(t0 + MS(20), 1)) {
+					lat[n++] = report_cycle - t0;
+					if (verbose)
+						printf("col %2d row %d  %llu cycles\n",
+							col, row, (unsigned long long)
+							(report_cycle - t0));
+				} else {
+					silent++;
+				}
+				// hold, let go, and wait out the debounce
+				run_until(avr->cycle + MS(5), 0);
+				held[col] &= ~(1 << row);
+				rows_update();
+				run_until(avr->cycle + MS(20), 0);
+			}
+		}
+	}
+
+	if (!n) {
+		printf("no reports\n");
+		return 1;
+	}
+	qsort(lat, n, sizeof(*lat), cmp);
+	printf("presses         %d, %d without a report\n", n + silent, silent);
+	printf("min             %llu cycles, %.1f us\n",
+		(unsigned long long)lat[0], lat[0] * 1e6 / F_CPU);
+	printf("median          %llu cycles, %.1f us\n",
+		(unsigned long long)lat[n / 2], lat[n / 2] * 1e6 / F_CPU);
+	printf("max             %llu cycles, %.1f us\n",
+		(unsigned long long)lat[n - 1], lat[n - 1] * 1e6 / F_CPU);
+	free(lat);
+	return 0;
+}
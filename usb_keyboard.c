@@ -26,6 +26,8 @@
 
 #define USB_SERIAL_PRIVATE_INCLUDE
 #include "usb_keyboard.h"
+#include "isr_stats.h"
+#include "matrix.h"
 
 /**************************************************************************
  *
@@ -64,14 +66,34 @@
 
 #define KEYBOARD_INTERFACE	0
 #define KEYBOARD_ENDPOINT	3
-#define KEYBOARD_SIZE		8
+#define KEYBOARD_SIZE		16
 #define KEYBOARD_BUFFER		EP_DOUBLE_BUFFER
 
+// Vendor defined HID interface for the configuration tool
+#define RAWHID_INTERFACE	1
+#define RAWHID_TX_ENDPOINT	1
+#define RAWHID_TX_BUFFER	EP_DOUBLE_BUFFER
+#define RAWHID_TX_INTERVAL	1
+#define RAWHID_RX_ENDPOINT	2
+#define RAWHID_RX_BUFFER	EP_DOUBLE_BUFFER
+#define RAWHID_RX_INTERVAL	1
+#define RAWHID_USAGE_PAGE	0xFFAB
+#define RAWHID_USAGE		0x0200
+
+// HID debug interface, read with hid_listen or host/debug_listen
+#define DEBUG_INTERFACE		2
+#define DEBUG_TX_ENDPOINT	4
+#define DEBUG_TX_BUFFER		EP_DOUBLE_BUFFER
+#define DEBUG_TX_INTERVAL	1
+
+// the descriptors, and below the interrupts that answer the host, only
+// for real USB hardware
+#if !defined(HOST_BUILD) && !defined(SIM_BUILD)
 static const uint8_t PROGMEM endpoint_config_table[] = {
-	0,
-	0,
+	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(RAWHID_TX_SIZE) | RAWHID_TX_BUFFER,
+	1, EP_TYPE_INTERRUPT_OUT, EP_SIZE(RAWHID_RX_SIZE) | RAWHID_RX_BUFFER,
 	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(KEYBOARD_SIZE) | KEYBOARD_BUFFER,
-	0
+	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(DEBUG_TX_SIZE) | DEBUG_TX_BUFFER
 };
 
 
@@ -105,7 +127,10 @@ static const uint8_t PROGMEM device_descriptor[] = {
 	1					// bNumConfigurations
 };
 
-// Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
+// Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60, with
+// the 6 key array replaced by a bitmap of keycodes 0 to 119.  Hosts
+// using the boot protocol ignore this and get the standard 8 byte
+// report instead.
 static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x05, 0x01,          // Usage Page (Generic Desktop),
         0x09, 0x06,          // Usage (Keyboard),
@@ -118,9 +143,6 @@ static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x15, 0x00,          //   Logical Minimum (0),
         0x25, 0x01,          //   Logical Maximum (1),
         0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Modifier byte
-        0x95, 0x01,          //   Report Count (1),
-        0x75, 0x08,          //   Report Size (8),
-        0x81, 0x03,          //   Input (Constant),                 ;Reserved byte
         0x95, 0x05,          //   Report Count (5),
         0x75, 0x01,          //   Report Size (1),
         0x05, 0x08,          //   Usage Page (LEDs),
@@ -130,26 +152,64 @@ static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x95, 0x01,          //   Report Count (1),
         0x75, 0x03,          //   Report Size (3),
         0x91, 0x03,          //   Output (Constant),                 ;LED report padding
-        0x95, 0x06,          //   Report Count (6),
-        0x75, 0x08,          //   Report Size (8),
+        0x95, 0x78,          //   Report Count (120),
+        0x75, 0x01,          //   Report Size (1),
         0x15, 0x00,          //   Logical Minimum (0),
-        0x25, 0x68,          //   Logical Maximum(104),
+        0x25, 0x01,          //   Logical Maximum (1),
         0x05, 0x07,          //   Usage Page (Key Codes),
         0x19, 0x00,          //   Usage Minimum (0),
-        0x29, 0x68,          //   Usage Maximum (104),
-        0x81, 0x00,          //   Input (Data, Array),
+        0x29, 0x77,          //   Usage Maximum (119),
+        0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Key bitmap
         0xc0                 // End Collection
 };
 
-#define CONFIG1_DESC_SIZE        (9+9+9+7)
+// Raw 64 byte reports each way, for the configuration protocol
+static const uint8_t PROGMEM rawhid_hid_report_desc[] = {
+	0x06, LSB(RAWHID_USAGE_PAGE), MSB(RAWHID_USAGE_PAGE),
+	0x0A, LSB(RAWHID_USAGE), MSB(RAWHID_USAGE),
+	0xA1, 0x01,				// Collection 0x01
+	0x75, 0x08,				// report size = 8 bits
+	0x15, 0x00,				// logical minimum = 0
+	0x26, 0xFF, 0x00,			// logical maximum = 255
+	0x95, RAWHID_TX_SIZE,			// report count
+	0x09, 0x01,				// usage
+	0x81, 0x02,				// Input (array)
+	0x95, RAWHID_RX_SIZE,			// report count
+	0x09, 0x02,				// usage
+	0x91, 0x02,				// Output (array)
+#ifdef ISR_STATS
+	0x95, ISR_STATS_REPORT_SIZE,		// report count
+	0x09, 0x03,				// usage
+	0xB1, 0x02,				// Feature (array)
+#endif
+	0xC0					// end collection
+};
+
+// The hid_listen protocol: vendor usage page 0xFF31, usage 0x74
+static const uint8_t PROGMEM debug_hid_report_desc[] = {
+	0x06, 0x31, 0xFF,			// Usage Page 0xFF31 (vendor defined)
+	0x09, 0x74,				// Usage 0x74
+	0xA1, 0x53,				// Collection 0x53
+	0x75, 0x08,				// report size = 8 bits
+	0x15, 0x00,				// logical minimum = 0
+	0x26, 0xFF, 0x00,			// logical maximum = 255
+	0x95, DEBUG_TX_SIZE,			// report count
+	0x09, 0x75,				// usage
+	0x81, 0x02,				// Input (array)
+	0xC0					// end collection
+};
+
+#define CONFIG1_DESC_SIZE        (9+9+9+7+9+9+7+7+9+9+7)
 #define KEYBOARD_HID_DESC_OFFSET (9+9)
+#define RAWHID_HID_DESC_OFFSET   (9+9+9+7+9)
+#define DEBUG_HID_DESC_OFFSET    (9+9+9+7+9+9+7+7+9)
 static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	// configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
 	9, 					// bLength;
 	2,					// bDescriptorType;
 	LSB(CONFIG1_DESC_SIZE),			// wTotalLength
 	MSB(CONFIG1_DESC_SIZE),
-	1,					// bNumInterfaces
+	3,					// bNumInterfaces
 	1,					// bConfigurationValue
 	0,					// iConfiguration
 	0xC0,					// bmAttributes
@@ -179,7 +239,66 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	KEYBOARD_ENDPOINT | 0x80,		// bEndpointAddress
 	0x03,					// bmAttributes (0x03=intr)
 	KEYBOARD_SIZE, 0,			// wMaxPacketSize
-	1					// bInterval
+	1,					// bInterval
+	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
+	9,					// bLength
+	4,					// bDescriptorType
+	RAWHID_INTERFACE,			// bInterfaceNumber
+	0,					// bAlternateSetting
+	2,					// bNumEndpoints
+	0x03,					// bInterfaceClass (0x03 = HID)
+	0x00,					// bInterfaceSubClass
+	0x00,					// bInterfaceProtocol
+	0,					// iInterface
+	// HID interface descriptor, HID 1.11 spec, section 6.2.1
+	9,					// bLength
+	0x21,					// bDescriptorType
+	0x11, 0x01,				// bcdHID
+	0,					// bCountryCode
+	1,					// bNumDescriptors
+	0x22,					// bDescriptorType
+	sizeof(rawhid_hid_report_desc),		// wDescriptorLength
+	0,
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,					// bLength
+	5,					// bDescriptorType
+	RAWHID_TX_ENDPOINT | 0x80,		// bEndpointAddress
+	0x03,					// bmAttributes (0x03=intr)
+	RAWHID_TX_SIZE, 0,			// wMaxPacketSize
+	RAWHID_TX_INTERVAL,			// bInterval
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,					// bLength
+	5,					// bDescriptorType
+	RAWHID_RX_ENDPOINT,			// bEndpointAddress
+	0x03,					// bmAttributes (0x03=intr)
+	RAWHID_RX_SIZE, 0,			// wMaxPacketSize
+	RAWHID_RX_INTERVAL,			// bInterval
+	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
+	9,					// bLength
+	4,					// bDescriptorType
+	DEBUG_INTERFACE,			// bInterfaceNumber
+	0,					// bAlternateSetting
+	1,					// bNumEndpoints
+	0x03,					// bInterfaceClass (0x03 = HID)
+	0x00,					// bInterfaceSubClass
+	0x00,					// bInterfaceProtocol
+	0,					// iInterface
+	// HID interface descriptor, HID 1.11 spec, section 6.2.1
+	9,					// bLength
+	0x21,					// bDescriptorType
+	0x11, 0x01,				// bcdHID
+	0,					// bCountryCode
+	1,					// bNumDescriptors
+	0x22,					// bDescriptorType
+	sizeof(debug_hid_report_desc),		// wDescriptorLength
+	0,
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,					// bLength
+	5,					// bDescriptorType
+	DEBUG_TX_ENDPOINT | 0x80,		// bEndpointAddress
+	0x03,					// bmAttributes (0x03=intr)
+	DEBUG_TX_SIZE, 0,			// wMaxPacketSize
+	DEBUG_TX_INTERVAL			// bInterval
 };
 
 // If you're desperate for a little extra code memory, these strings
@@ -218,11 +337,16 @@ static const struct descriptor_list_struct {
 	{0x0200, 0x0000, config1_descriptor, sizeof(config1_descriptor)},
 	{0x2200, KEYBOARD_INTERFACE, keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
 	{0x2100, KEYBOARD_INTERFACE, config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
+	{0x2200, RAWHID_INTERFACE, rawhid_hid_report_desc, sizeof(rawhid_hid_report_desc)},
+	{0x2100, RAWHID_INTERFACE, config1_descriptor+RAWHID_HID_DESC_OFFSET, 9},
+	{0x2200, DEBUG_INTERFACE, debug_hid_report_desc, sizeof(debug_hid_report_desc)},
+	{0x2100, DEBUG_INTERFACE, config1_descriptor+DEBUG_HID_DESC_OFFSET, 9},
 	{0x0300, 0x0000, (const uint8_t *)&string0, 4},
 	{0x0301, 0x0409, (const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
 	{0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)}
 };
 #define NUM_DESC_LIST (sizeof(descriptor_list)/sizeof(struct descriptor_list_struct))
+#endif
 
 
 /**************************************************************************
@@ -239,12 +363,14 @@ static volatile uint8_t usb_configuration=0;
 // 16=right ctrl, 32=right shift, 64=right alt, 128=right gui
 uint8_t keyboard_modifier_keys=0;
 
-// which keys are currently pressed, up to 6 keys may be down at once
+// which keys are currently pressed, one bit per keycode
+uint8_t keyboard_nkro_keys[KEYBOARD_NKRO_SIZE];
+
+// the boot protocol report, up to 6 of the keys in keyboard_nkro_keys
 uint8_t keyboard_keys[MAX_NUM_KEYS];
 
-// protocol setting from the host.  We use exactly the same report
-// either way, so this variable only stores the setting since we
-// are required to be able to report which setting is in use.
+// protocol setting from the host.  1 = report protocol, where the
+// whole bitmap is sent, 0 = boot protocol and its 6 key report.
 static uint8_t keyboard_protocol=1;
 
 // the idle configuration, how often we send the report to the
@@ -254,10 +380,44 @@ static uint8_t keyboard_idle_config=125;
 // count until idle timeout
 static uint8_t keyboard_idle_count=0;
 
+// start of frame count, one per millisecond while configured
+static volatile uint16_t usb_frame_count=0;
+
 // 1=num lock, 2=caps lock, 4=scroll lock, 8=compose, 16=kana
 volatile uint8_t keyboard_leds=0;
 
 
+// A report as staged for the keyboard endpoint
+struct keyboard_report {
+	uint8_t mods;
+	uint8_t keys[KEYBOARD_NKRO_SIZE];
+};
+
+// reports waiting for a free endpoint bank, oldest at the head
+static struct keyboard_report keyboard_queue[KEYBOARD_QUEUE_DEPTH];
+static volatile uint8_t keyboard_queue_head=0;
+static volatile uint8_t keyboard_queue_count=0;
+
+// the last report handed to the endpoint
+static struct keyboard_report keyboard_last;
+
+static void usb_keyboard_snapshot(struct keyboard_report *report);
+static uint8_t usb_keyboard_unchanged(const struct keyboard_report *report);
+static uint8_t usb_keyboard_can_merge(const struct keyboard_report *prev,
+	const struct keyboard_report *tail);
+static void usb_keyboard_flush(void);
+static inline void usb_keyboard_sof(void);
+
+// debug output waiting for the start of frame
+static uint8_t debug_buffer[DEBUG_BUFFER_SIZE];
+static volatile uint8_t debug_head=0;
+static volatile uint8_t debug_tail=0;
+
+// debug bytes lost so far because the buffer was full
+volatile uint16_t usb_debug_dropped=0;
+static inline void usb_debug_sof(void);
+
+
 /**************************************************************************
  *
  *  Public Functions - these are the API intended for the user
@@ -265,7 +425,20 @@ volatile uint8_t keyboard_leds=0;
  **************************************************************************/
 
 
+// milliseconds, counted by start of frame while the USB is configured
+uint16_t usb_ms(void)
+{
+	uint16_t ms;
+	uint8_t intr_state = SREG;
+
+	cli();
+	ms = usb_frame_count;
+	SREG = intr_state;
+	return ms;
+}
+
 // initialize USB
+#if !defined(HOST_BUILD) && !defined(SIM_BUILD)
 void usb_init(void)
 {
 	HW_CONFIG();
@@ -278,6 +451,14 @@ void usb_init(void)
         UDIEN = (1<<EORSTE)|(1<<SOFE);
 	sei();
 }
+#else
+// the simulated host enumerates us immediately, and under simavr there
+// is no USB to start
+void usb_init(void)
+{
+	usb_configuration = 1;
+}
+#endif
 
 // return 0 if the USB is not configured, or the configuration
 // number selected by the HOST
@@ -287,60 +468,306 @@ uint8_t usb_configured(void)
 }
 
 
-// perform a single keystroke
+// perform a single keystroke; a key code past the bitmap is left out,
+// as the keymap does, and only the modifier goes
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
 {
 	int8_t r;
 
+	if (key >= KEYBOARD_NKRO_KEYS) key = 0;
 	keyboard_modifier_keys = modifier;
-	keyboard_keys[0] = key;
+	if (key) keyboard_nkro_keys[key >> 3] |= 1 << (key & 7);
 	r = usb_keyboard_send();
 	if (r) return r;
 	keyboard_modifier_keys = 0;
-	keyboard_keys[0] = 0;
+	if (key) keyboard_nkro_keys[key >> 3] &= ~(1 << (key & 7));
 	return usb_keyboard_send();
 }
 
-// send the contents of keyboard_keys and keyboard_modifier_keys
+// Stage the contents of keyboard_nkro_keys and keyboard_modifier_keys
+// for the keyboard endpoint.  This never waits: the report goes into a
+// free endpoint bank right away if there is one, otherwise the start
+// of frame interrupt loads it later.  A staged report that has not gone
+// out yet is replaced by the new one as long as no key changes state
+// twice between them, so bursts are merged without ever losing a
+// press/release pair.  Returns -1 if not configured, or if all the
+// staging slots hold reports that can't be merged; try again later.
 int8_t usb_keyboard_send(void)
 {
-	uint8_t i, intr_state, timeout;
+	struct keyboard_report *tail, *prev;
+	uint8_t intr_state, n;
+	int8_t r = 0;
 
 	if (!usb_configuration) return -1;
 	intr_state = SREG;
 	cli();
-	UENUM = KEYBOARD_ENDPOINT;
-	timeout = UDFNUML + 50;
-	while (1) {
-		// are we ready to transmit?
-		if (UEINTX & (1<<RWAL)) break;
+	n = keyboard_queue_count;
+	tail = prev = &keyboard_last;
+	if (n) {
+		tail = &keyboard_queue[(keyboard_queue_head + n - 1) % KEYBOARD_QUEUE_DEPTH];
+		if (n > 1) prev = &keyboard_queue[(keyboard_queue_head + n - 2) % KEYBOARD_QUEUE_DEPTH];
+	}
+	if (usb_keyboard_unchanged(tail)) {
+		// nothing new for the host
+	} else if (n && usb_keyboard_can_merge(prev, tail)) {
+		usb_keyboard_snapshot(tail);
+	} else if (n < KEYBOARD_QUEUE_DEPTH) {
+		usb_keyboard_snapshot(&keyboard_queue[(keyboard_queue_head + n) % KEYBOARD_QUEUE_DEPTH]);
+		keyboard_queue_count = n + 1;
+		usb_keyboard_flush();
+	} else {
+		r = -1;
+	}
+	SREG = intr_state;
+	return r;
+}
+
+// Receive a packet from the configuration interface into buffer, which
+// must hold RAWHID_RX_SIZE bytes.  Never waits: returns the number of
+// bytes read, or 0 if no packet has arrived.
+int8_t usb_rawhid_recv(uint8_t *buffer)
+{
+	uint8_t intr_state, i;
+
+	if (!usb_configuration) return -1;
+	intr_state = SREG;
+	cli();
+	HAL_EP_SELECT(RAWHID_RX_ENDPOINT);
+	if (!HAL_EP_READABLE()) {
 		SREG = intr_state;
-		// has the USB gone offline?
-		if (!usb_configuration) return -1;
-		// have we waited too long?
-		if (UDFNUML == timeout) return -1;
-		// get ready to try checking again
-		intr_state = SREG;
-		cli();
-		UENUM = KEYBOARD_ENDPOINT;
+		return 0;
 	}
-	UEDATX = keyboard_modifier_keys;
-	UEDATX = 0;
-	for (i=0; i<6; i++) {
-		UEDATX = keyboard_keys[i];
+	for (i=0; i<RAWHID_RX_SIZE; i++) {
+		*buffer++ = HAL_EP_READ();
 	}
-	UEINTX = 0x3A;
-	keyboard_idle_count = 0;
+	HAL_EP_RELEASE_OUT();
+	SREG = intr_state;
+	return RAWHID_RX_SIZE;
+}
+
+// Send a packet of RAWHID_TX_SIZE bytes on the configuration interface.
+// Never waits: returns 0 if both endpoint banks are still full, so the
+// caller should try again later.
+int8_t usb_rawhid_send(const uint8_t *buffer)
+{
+	uint8_t intr_state, i;
+
+	if (!usb_configuration) return -1;
+	intr_state = SREG;
+	cli();
+	HAL_EP_SELECT(RAWHID_TX_ENDPOINT);
+	if (!HAL_EP_WRITABLE()) {
+		SREG = intr_state;
+		return 0;
+	}
+	for (i=0; i<RAWHID_TX_SIZE; i++) {
+		HAL_EP_WRITE(*buffer++);
+	}
+	HAL_EP_RELEASE();
+	SREG = intr_state;
+	return RAWHID_TX_SIZE;
+}
+
+// Queue a byte for the debug interface.  Only copies it into the
+// buffer, so it is safe from any interrupt; if the buffer is full the
+// byte is dropped and counted, and -1 returned.
+int8_t usb_debug_putchar(uint8_t c)
+{
+	uint8_t intr_state, head;
+
+	intr_state = SREG;
+	cli();
+	head = (debug_head + 1) & (DEBUG_BUFFER_SIZE - 1);
+	if (head == debug_tail) {
+		usb_debug_dropped++;
+		SREG = intr_state;
+		return -1;
+	}
+	debug_buffer[debug_head] = c;
+	debug_head = head;
 	SREG = intr_state;
 	return 0;
 }
 
+// number of reports staged and not yet handed to the endpoint
+uint8_t usb_keyboard_queued(void)
+{
+	return keyboard_queue_count;
+}
+
 /**************************************************************************
  *
  *  Private Functions - not intended for general user consumption....
  *
  **************************************************************************/
 
+// Fill keyboard_keys[] with the first 6 keys of the bitmap, or with
+// ErrorRollOver if more than that are down, as the boot protocol wants
+static void usb_keyboard_boot_keys(const struct keyboard_report *report)
+{
+	uint8_t i, bits, key, n = 0;
+
+	for (i=0; i<KEYBOARD_NKRO_SIZE; i++) {
+		bits = report->keys[i];
+		for (key = i << 3; bits; key++, bits >>= 1) {
+			if (!(bits & 1)) continue;
+			if (n == MAX_NUM_KEYS) {
+				for (n=0; n<MAX_NUM_KEYS; n++) {
+					keyboard_keys[n] = KEY_ERROR_ROLLOVER;
+				}
+				return;
+			}
+			keyboard_keys[n++] = key;
+		}
+	}
+	while (n < MAX_NUM_KEYS) keyboard_keys[n++] = 0;
+}
+
+// write a report for the current protocol into the selected endpoint
+static void usb_keyboard_fill_report(const struct keyboard_report *report)
+{
+	uint8_t i;
+
+	HAL_EP_WRITE(report->mods);
+	if (keyboard_protocol) {
+		for (i=0; i<KEYBOARD_NKRO_SIZE; i++) {
+			HAL_EP_WRITE(report->keys[i]);
+		}
+	} else {
+		usb_keyboard_boot_keys(report);
+		HAL_EP_WRITE(0);
+		for (i=0; i<MAX_NUM_KEYS; i++) {
+			HAL_EP_WRITE(keyboard_keys[i]);
+		}
+	}
+}
+
+// write a report and hand the bank to the USB controller
+static void usb_keyboard_write_report(const struct keyboard_report *report)
+{
+	usb_keyboard_fill_report(report);
+	HAL_EP_RELEASE();
+}
+
+// copy the current keys and modifiers into a staging slot
+static void usb_keyboard_snapshot(struct keyboard_report *report)
+{
+	uint8_t i;
+
+	report->mods = keyboard_modifier_keys;
+	for (i=0; i<KEYBOARD_NKRO_SIZE; i++) {
+		report->keys[i] = keyboard_nkro_keys[i];
+	}
+}
+
+// is the current state the same as this report
+static uint8_t usb_keyboard_unchanged(const struct keyboard_report *report)
+{
+	uint8_t i;
+
+	if (report->mods != keyboard_modifier_keys) return 0;
+	for (i=0; i<KEYBOARD_NKRO_SIZE; i++) {
+		if (report->keys[i] != keyboard_nkro_keys[i]) return 0;
+	}
+	return 1;
+}
+
+// The staged report tail, which follows prev, may be replaced by the
+// current state only if no bit that changed from prev to tail changes
+// back again; otherwise the host would miss a press or a release.
+static uint8_t usb_keyboard_can_merge(const struct keyboard_report *prev,
+	const struct keyboard_report *tail)
+{
+	uint8_t i;
+
+	if ((prev->mods ^ tail->mods) & (tail->mods ^ keyboard_modifier_keys)) return 0;
+	for (i=0; i<KEYBOARD_NKRO_SIZE; i++) {
+		if ((prev->keys[i] ^ tail->keys[i]) &
+		  (tail->keys[i] ^ keyboard_nkro_keys[i])) return 0;
+	}
+	return 1;
+}
+
+// Move staged reports into whatever endpoint banks are free.  Must be
+// called with interrupts disabled.
+static void usb_keyboard_flush(void)
+{
+	HAL_EP_SELECT(KEYBOARD_ENDPOINT);
+	while (keyboard_queue_count && HAL_EP_WRITABLE()) {
+		keyboard_last = keyboard_queue[keyboard_queue_head];
+		if (++keyboard_queue_head >= KEYBOARD_QUEUE_DEPTH) keyboard_queue_head = 0;
+		keyboard_queue_count--;
+		usb_keyboard_write_report(&keyboard_last);
+		keyboard_idle_count = 0;
+	}
+}
+
+// start of frame: send what the debug buffer holds, a packet per free
+// endpoint bank, zero padded (hid_listen skips zeros)
+static inline void usb_debug_sof(void)
+{
+	uint8_t tail = debug_tail, i;
+
+	if (tail == debug_head) return;
+	HAL_EP_SELECT(DEBUG_TX_ENDPOINT);
+	while (tail != debug_head && HAL_EP_WRITABLE()) {
+		for (i=0; i<DEBUG_TX_SIZE; i++) {
+			if (tail != debug_head) {
+				HAL_EP_WRITE(debug_buffer[tail]);
+				tail = (tail + 1) & (DEBUG_BUFFER_SIZE - 1);
+			} else {
+				HAL_EP_WRITE(0);
+			}
+		}
+		HAL_EP_RELEASE();
+	}
+	debug_tail = tail;
+}
+
+// start of frame: load any staged reports, otherwise resend the last
+// report whenever the idle period requested by the host runs out
+static inline void usb_keyboard_sof(void)
+{
+	static uint8_t div4=0;
+
+	usb_frame_count++;
+	if (keyboard_queue_count) {
+		usb_keyboard_flush();
+		return;
+	}
+	if (keyboard_idle_config && (++div4 & 3) == 0) {
+		HAL_EP_SELECT(KEYBOARD_ENDPOINT);
+		if (HAL_EP_WRITABLE()) {
+			keyboard_idle_count++;
+			if (keyboard_idle_count == keyboard_idle_config) {
+				keyboard_idle_count = 0;
+				usb_keyboard_write_report(&keyboard_last);
+			}
+		}
+	}
+}
+
+#ifdef HOST_BUILD
+// there is no USB_GEN_vect in the native build, the simulated host
+// calls this once per 1 ms frame instead
+void usb_host_frame(void)
+{
+	hal_host_frame++;
+	if (usb_configuration) {
+#ifdef SCAN_SOF_SYNC
+		matrix_sof();
+#endif
+		usb_keyboard_sof();
+		usb_debug_sof();
+	}
+}
+
+// stand-in for the host's HID_SET_PROTOCOL request
+void usb_host_set_protocol(uint8_t protocol)
+{
+	keyboard_protocol = protocol;
+}
+#elif !defined(SIM_BUILD)
 
 
 // USB Device Interrupt - handle all device-level events
@@ -348,8 +775,8 @@ int8_t usb_keyboard_send(void)
 //
 ISR(USB_GEN_vect)
 {
-	uint8_t intbits, i;
-	static uint8_t div4=0;
+	uint8_t intbits;
+	ISR_STATS_ENTER(0);
 
         intbits = UDINT;
         UDINT = 0;
@@ -360,24 +787,17 @@ ISR(USB_GEN_vect)
 		UECFG1X = EP_SIZE(ENDPOINT0_SIZE) | EP_SINGLE_BUFFER;
 		UEIENX = (1<<RXSTPE);
 		usb_configuration = 0;
+		keyboard_protocol = 1;
         }
 	if ((intbits & (1<<SOFI)) && usb_configuration) {
-		if (keyboard_idle_config && (++div4 & 3) == 0) {
-			UENUM = KEYBOARD_ENDPOINT;
-			if (UEINTX & (1<<RWAL)) {
-				keyboard_idle_count++;
-				if (keyboard_idle_count == keyboard_idle_config) {
-					keyboard_idle_count = 0;
-					UEDATX = keyboard_modifier_keys;
-					UEDATX = 0;
-					for (i=0; i<6; i++) {
-						UEDATX = keyboard_keys[i];
-					}
-					UEINTX = 0x3A;
-				}
-			}
-		}
+#ifdef SCAN_SOF_SYNC
+		// first, while the timer 0 count is closest to the frame
+		matrix_sof();
+#endif
+		usb_keyboard_sof();
+		usb_debug_sof();
 	}
+	ISR_STATS_EXIT(ISR_STATS_USB_GEN);
 }
 
 
@@ -406,7 +826,7 @@ static inline void usb_ack_out(void)
 // other endpoints are manipulated by the user-callable
 // functions, and the start-of-frame interrupt.
 //
-ISR(USB_COM_vect)
+static inline void usb_com(void)
 {
         uint8_t intbits;
 	const uint8_t *list;
@@ -542,11 +962,7 @@ ISR(USB_COM_vect)
 			if (bmRequestType == 0xA1) {
 				if (bRequest == HID_GET_REPORT) {
 					usb_wait_in_ready();
-					UEDATX = keyboard_modifier_keys;
-					UEDATX = 0;
-					for (i=0; i<6; i++) {
-						UEDATX = keyboard_keys[i];
-					}
+					usb_keyboard_fill_report(&keyboard_last);
 					usb_send_in();
 					return;
 				}
@@ -584,8 +1000,48 @@ ISR(USB_COM_vect)
 				}
 			}
 		}
+		#ifdef ISR_STATS
+		// the interrupt statistics, as a feature report
+		if (wIndex == RAWHID_INTERFACE && (wValue >> 8) == 3) {
+			if (bmRequestType == 0xA1 && bRequest == HID_GET_REPORT) {
+				len = (wLength < ISR_STATS_REPORT_SIZE) ?
+					wLength : ISR_STATS_REPORT_SIZE;
+				en = 0;
+				do {
+					do {
+						i = UEINTX;
+					} while (!(i & ((1<<TXINI)|(1<<RXOUTI))));
+					if (i & (1<<RXOUTI)) return;	// abort
+					n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
+					for (i = n; i; i--) {
+						UEDATX = isr_stats_read(en++);
+					}
+					len -= n;
+					usb_send_in();
+				} while (len || n == ENDPOINT0_SIZE);
+				return;
+			}
+			if (bmRequestType == 0x21 && bRequest == HID_SET_REPORT) {
+				while (wLength) {
+					usb_wait_receive_out();
+					wLength -= wLength < ENDPOINT0_SIZE ?
+						wLength : ENDPOINT0_SIZE;
+					usb_ack_out();
+				}
+				isr_stats_clear();
+				usb_send_in();
+				return;
+			}
+		}
+		#endif
 	}
 	UECONX = (1<<STALLRQ) | (1<<EPEN);	// stall
 }
 
-
+ISR(USB_COM_vect)
+{
+	ISR_STATS_ENTER(0);
+	usb_com();
+	ISR_STATS_EXIT(ISR_STATS_USB_COM);
+}
+#endif
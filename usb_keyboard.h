@@ -7,19 +7,47 @@
 // Dont forget to initialize the values to zero
 #define MAX_NUM_KEYS 6
 
+// Keys are tracked in a bitmap covering keycodes 0 to 119, which is
+// sent as is in report protocol (N-key rollover).  Boot protocol hosts
+// get the usual 6 key report, built from the bitmap into keyboard_keys[].
+#define KEYBOARD_NKRO_KEYS	120
+#define KEYBOARD_NKRO_SIZE	(KEYBOARD_NKRO_KEYS / 8)
+
+// Reports that usb_keyboard_send() can stage while the endpoint banks
+// are busy, see usb_keyboard_queued()
+#define KEYBOARD_QUEUE_DEPTH	3
+
 void usb_init(void);			// initialize everything
 uint8_t usb_configured(void);		// is the USB port configured
+uint16_t usb_ms(void);			// 1 ms frames while configured
+
+// Vendor defined HID interface, RAWHID_TX_SIZE byte packets to the
+// host and RAWHID_RX_SIZE byte packets from it
+#define RAWHID_TX_SIZE		64
+#define RAWHID_RX_SIZE		64
+int8_t usb_rawhid_recv(uint8_t *buffer);
+int8_t usb_rawhid_send(const uint8_t *buffer);
 
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier);
 int8_t usb_keyboard_send(void);
+uint8_t usb_keyboard_queued(void);
 extern uint8_t keyboard_modifier_keys;
 extern uint8_t keyboard_keys[MAX_NUM_KEYS];
+extern uint8_t keyboard_nkro_keys[KEYBOARD_NKRO_SIZE];
 extern volatile uint8_t keyboard_leds;
 
-// This file does not include the HID debug functions, so these empty
-// macros replace them with nothing, so users can compile code that
-// has calls to these functions.
-#define usb_debug_putchar(c)
+// HID debug interface (PJRC's hid_listen protocol).  usb_debug_putchar()
+// only copies into a DEBUG_BUFFER_SIZE byte buffer, so it can be used
+// from interrupts; the start of frame interrupt sends what is there,
+// a DEBUG_TX_SIZE byte packet per free endpoint bank, so there is
+// nothing to flush.  Bytes that find the buffer full are dropped and
+// counted.  See print.h for strings and numbers.
+#define DEBUG_TX_SIZE		32
+#ifndef DEBUG_BUFFER_SIZE
+#define DEBUG_BUFFER_SIZE	128	// must be a power of 2, at most 256
+#endif
+int8_t usb_debug_putchar(uint8_t c);
+extern volatile uint16_t usb_debug_dropped;
 #define usb_debug_flush_output()
 
 
@@ -36,6 +64,7 @@ extern volatile uint8_t keyboard_leds;
 #define KEY_RIGHT_ALT	0x40
 #define KEY_RIGHT_GUI	0x80
 
+#define KEY_ERROR_ROLLOVER	1
 #define KEY_A		4
 #define KEY_B		5
 #define KEY_C		6
@@ -138,9 +167,7 @@ extern volatile uint8_t keyboard_leds;
 
 // Everything below this point is only intended for usb_serial.c
 #ifdef USB_SERIAL_PRIVATE_INCLUDE
-#include <avr/io.h>
-#include <avr/pgmspace.h>
-#include <avr/interrupt.h>
+#include "hal.h"
 
 #define EP_TYPE_CONTROL			0x00
 #define EP_TYPE_BULK_IN			0x81